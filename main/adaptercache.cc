@@ -0,0 +1,92 @@
+#include "adaptercache.hh"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // getpid
+
+// The cache file is text with one "key value" pair per line:
+//
+//   backend 3
+//   name NVIDIA GeForce RTX 3070
+//   vendor 4318
+//   device 9348
+//   limit.maxBindGroups 4
+//   ...
+
+bool AdapterCacheEntry::matches(const wgpu::AdapterProperties& p, const wgpu::Limits& l) const {
+#define HAS_LIMIT(field) &&l.field >= limits.field
+  return p.backendType == backendType && p.vendorID == vendorID && p.deviceID == deviceID &&
+         name == (p.name != nullptr ? p.name : "") ADAPTER_CACHE_LIMITS(HAS_LIMIT);
+#undef HAS_LIMIT
+}
+
+bool AdapterCacheEntry::operator==(const AdapterCacheEntry& b) const {
+#define CMP_LIMIT(field) &&limits.field == b.limits.field
+  return backendType == b.backendType && name == b.name && vendorID == b.vendorID &&
+         deviceID == b.deviceID ADAPTER_CACHE_LIMITS(CMP_LIMIT);
+#undef CMP_LIMIT
+}
+
+bool adapterCacheLoad(const char* filename, AdapterCacheEntry* entry) {
+  FILE* f = fopen(filename, "r");
+  if (f == nullptr) {
+    return false;
+  }
+  AdapterCacheEntry e;
+  bool haveBackend = false;
+  char line[512];
+  while (fgets(line, sizeof(line), f) != nullptr) {
+    line[strcspn(line, "\n")] = 0;
+    char* value = strchr(line, ' ');
+    if (value == nullptr) {
+      continue;
+    }
+    *value++ = 0;
+    if (strcmp(line, "backend") == 0) {
+      e.backendType = (wgpu::BackendType)strtoul(value, nullptr, 10);
+      haveBackend = true;
+    } else if (strcmp(line, "name") == 0) {
+      e.name = value;
+    } else if (strcmp(line, "vendor") == 0) {
+      e.vendorID = (uint32_t)strtoul(value, nullptr, 10);
+    } else if (strcmp(line, "device") == 0) {
+      e.deviceID = (uint32_t)strtoul(value, nullptr, 10);
+    }
+#define LOAD_LIMIT(field)                                                                          \
+  else if (strcmp(line, "limit." #field) == 0) {                                                   \
+    e.limits.field = (decltype(e.limits.field))strtoull(value, nullptr, 10);                       \
+  }
+    ADAPTER_CACHE_LIMITS(LOAD_LIMIT)
+#undef LOAD_LIMIT
+  }
+  fclose(f);
+  if (!haveBackend) {
+    return false;
+  }
+  *entry = std::move(e);
+  return true;
+}
+
+bool adapterCacheStore(const char* filename, const AdapterCacheEntry& e) {
+  char tmpname[4096];
+  snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", filename, (int)getpid());
+  FILE* f = fopen(tmpname, "w");
+  if (f == nullptr) {
+    return false;
+  }
+  fprintf(f, "backend %u\nname %s\nvendor %u\ndevice %u\n", (uint32_t)e.backendType,
+          e.name.c_str(), e.vendorID, e.deviceID);
+#define STORE_LIMIT(field)                                                                         \
+  fprintf(f, "limit." #field " %llu\n", (unsigned long long)e.limits.field);
+  ADAPTER_CACHE_LIMITS(STORE_LIMIT)
+#undef STORE_LIMIT
+  if (fclose(f) != 0 || rename(tmpname, filename) != 0) {
+    int err = errno;
+    unlink(tmpname);
+    errno = err;
+    return false;
+  }
+  return true;
+}
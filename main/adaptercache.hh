@@ -0,0 +1,36 @@
+#pragma once
+#include <dawn/webgpu_cpp.h>
+
+#include <string>
+
+// ADAPTER_CACHE_LIMITS lists the adapter limits recorded in the adapter cache (all maxima)
+#define ADAPTER_CACHE_LIMITS(_)                                                                    \
+  _(maxStorageBufferBindingSize)                                                                   \
+  _(maxComputeWorkgroupsPerDimension)                                                              \
+  _(maxBufferSize)                                                                                 \
+  _(maxBindGroups)                                                                                 \
+  _(maxComputeInvocationsPerWorkgroup)
+
+// AdapterCacheEntry describes the adapter chosen by a previous run of the server, so that
+// adapter discovery can be limited to its backend on the next start. The adapter found
+// there is only used if it still has the recorded limits, which clients may depend on.
+struct AdapterCacheEntry {
+  wgpu::BackendType backendType = wgpu::BackendType::Null;
+  std::string name;
+  uint32_t vendorID = 0;
+  uint32_t deviceID = 0;
+  wgpu::Limits limits;
+
+  // matches returns true if p describes the same adapter and l has at least the recorded
+  // limits (which fails after e.g. a driver update lowered them, or without a record)
+  bool matches(const wgpu::AdapterProperties& p, const wgpu::Limits& l) const;
+  bool operator==(const AdapterCacheEntry&) const;
+};
+
+// adapterCacheLoad reads an entry from filename. Returns false if the file does not exist
+// or is invalid.
+bool adapterCacheLoad(const char* filename, AdapterCacheEntry* entry);
+
+// adapterCacheStore writes entry to filename, atomically replacing any existing file.
+// Returns false on error with errno set.
+bool adapterCacheStore(const char* filename, const AdapterCacheEntry& entry);
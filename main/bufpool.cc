@@ -0,0 +1,73 @@
+#include "bufpool.hh"
+
+size_t BufferPool::sizeClass(size_t size) {
+  size_t c = BUFPOOL_MIN_SIZE;
+  while (c < size) {
+    c <<= 1;
+  }
+  return c;
+}
+
+// makeRoom frees idle buffers, largest first, until size more bytes fit within maxBytes
+bool BufferPool::makeRoom(size_t size) {
+  auto it = _idle.end();
+  while (_stats.bytesInUse + _stats.bytesIdle + size > maxBytes) {
+    if (it == _idle.begin()) {
+      return false;
+    }
+    --it;
+    std::vector<wgpu::Buffer>& buffers = it->second;
+    while (!buffers.empty() && _stats.bytesInUse + _stats.bytesIdle + size > maxBytes) {
+      buffers.back().Destroy();
+      buffers.pop_back();
+      _stats.bytesIdle -= it->first.first;
+      _stats.frees++;
+    }
+  }
+  return true;
+}
+
+wgpu::Buffer BufferPool::acquire(size_t size, wgpu::BufferUsage usage) {
+  size_t c = sizeClass(size);
+  auto it = _idle.find(Key(c, (uint32_t)usage));
+  if (it != _idle.end() && !it->second.empty()) {
+    wgpu::Buffer buffer = std::move(it->second.back());
+    it->second.pop_back();
+    _stats.bytesIdle -= c;
+    _stats.bytesInUse += c;
+    _stats.reuses++;
+    return buffer;
+  }
+  if (!makeRoom(c)) {
+    _stats.failures++;
+    return nullptr;
+  }
+  wgpu::BufferDescriptor desc;
+  desc.size = c;
+  desc.usage = usage;
+  wgpu::Buffer buffer = _device.CreateBuffer(&desc);
+  _stats.bytesInUse += c;
+  _stats.creates++;
+  return buffer;
+}
+
+void BufferPool::release(wgpu::Buffer buffer, size_t size, wgpu::BufferUsage usage) {
+  if (!buffer) {
+    return;
+  }
+  size_t c = sizeClass(size);
+  _stats.bytesInUse -= c;
+  _stats.bytesIdle += c;
+  _idle[Key(c, (uint32_t)usage)].push_back(std::move(buffer));
+}
+
+void BufferPool::trim() {
+  for (auto& it : _idle) {
+    for (wgpu::Buffer& buffer : it.second) {
+      buffer.Destroy();
+      _stats.frees++;
+    }
+    _stats.bytesIdle -= it.first.first * it.second.size();
+  }
+  _idle.clear();
+}
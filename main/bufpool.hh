@@ -0,0 +1,55 @@
+#pragma once
+#include <dawn/webgpu_cpp.h>
+
+#include <map>
+#include <vector>
+
+// BufferPool recycles buffers, so that in steady state no buffers are created, neither on
+// the wire nor on the GPU.
+//
+// Buffers are pooled by usage and size class (powers of two, at least BUFPOOL_MIN_SIZE).
+// A buffer returned by acquire may be larger than requested. The pool creates a new
+// buffer only when there is no idle one of the same usage and class. The total size of
+// buffers in use and idle is limited by maxBytes; idle buffers are freed to make room.
+// A buffer must be unmapped before it is released.
+#define BUFPOOL_MIN_SIZE 256
+
+class BufferPool {
+public:
+  size_t maxBytes = 256 * 1024 * 1024; // limit of bytes in use + bytes idle
+
+  struct Stats {
+    uint64_t creates = 0;  // buffers created
+    uint64_t reuses = 0;   // acquire calls served by an idle buffer
+    uint64_t frees = 0;    // idle buffers freed by trim or to stay below maxBytes
+    uint64_t failures = 0; // acquire calls refused because of maxBytes
+    size_t bytesInUse = 0;
+    size_t bytesIdle = 0;
+  };
+
+  explicit BufferPool(wgpu::Device device) : _device(device) {}
+
+  // acquire returns a buffer of at least size bytes with the given usage.
+  // Returns null if that would exceed maxBytes.
+  wgpu::Buffer acquire(size_t size, wgpu::BufferUsage usage);
+
+  // release returns a buffer to the pool. size and usage must be those passed to acquire.
+  void release(wgpu::Buffer buffer, size_t size, wgpu::BufferUsage usage);
+
+  // trim frees all idle buffers
+  void trim();
+
+  const Stats& stats() const {
+    return _stats;
+  }
+
+  static size_t sizeClass(size_t size);
+
+private:
+  using Key = std::pair<size_t, uint32_t>; // size class, usage
+  bool makeRoom(size_t size);
+
+  wgpu::Device _device;
+  std::map<Key, std::vector<wgpu::Buffer>> _idle;
+  Stats _stats;
+};
@@ -0,0 +1,177 @@
+#include "capture.hh"
+#include "log.hh"     // errlog
+#include "metrics.hh" // metricsNow
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CAPTURE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+CaptureWriter::~CaptureWriter() {
+  close();
+}
+
+bool CaptureWriter::open(const char* path) {
+  close();
+  _fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (_fd < 0) {
+    return false;
+  }
+  _offs = 0;
+  _start = metricsNow();
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  CaptureHeader h = {};
+  memcpy(h.magic, CAPTURE_MAGIC, 4);
+  h.version = CAPTURE_VERSION;
+  h.startTime = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+  char* p = reserve(sizeof(h));
+  if (p == nullptr) {
+    int e = errno;
+    close();
+    errno = e;
+    return false;
+  }
+  memcpy(p, &h, sizeof(h));
+  _offs += sizeof(h);
+  return true;
+}
+
+void CaptureWriter::close() {
+  if (_map != nullptr) {
+    munmap(_map, _mapLen);
+    _map = nullptr;
+  }
+  if (_fd != -1) {
+    // cut off the zero fill past the last record
+    if (ftruncate(_fd, (off_t)_offs) == -1) {
+      errlog("failed to truncate capture file to %llu bytes: %s", (unsigned long long)_offs,
+             strerror(errno));
+    }
+    ::close(_fd);
+    _fd = -1;
+  }
+}
+
+// reserve returns a pointer to n bytes of the file at _offs, moving the mapping and
+// growing the file as needed
+char* CaptureWriter::reserve(size_t n) {
+  if (_map != nullptr && _offs + n <= _mapBase + _mapLen) {
+    return _map + (_offs - _mapBase);
+  }
+  if (_map != nullptr) {
+    munmap(_map, _mapLen);
+    _map = nullptr;
+  }
+  uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+  _mapBase = _offs & ~(pageSize - 1);
+  _mapLen = std::max((size_t)CAPTURE_MAP_SIZE, (size_t)(_offs - _mapBase + n));
+  _mapLen = (_mapLen + pageSize - 1) & ~(pageSize - 1);
+  if (ftruncate(_fd, (off_t)(_mapBase + _mapLen)) == -1) {
+    return nullptr;
+  }
+  void* p = mmap(nullptr, _mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, (off_t)_mapBase);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  _map = (char*)p;
+  return _map + (_offs - _mapBase);
+}
+
+bool CaptureWriter::add(CaptureType type, const void* data, size_t len) {
+  if (_fd == -1 || len > UINT32_MAX) {
+    return false;
+  }
+  size_t n = sizeof(CaptureRecord) + CAPTURE_ALIGN(len);
+  char* p = reserve(n);
+  if (p == nullptr) {
+    close(); // e.g. the disk is full; keep what has been captured so far
+    return false;
+  }
+  CaptureRecord rec = {};
+  rec.time = metricsNow() - _start;
+  rec.len = (uint32_t)len;
+  rec.type = type;
+  memcpy(p, &rec, sizeof(rec));
+  if (len > 0) {
+    memcpy(p + sizeof(rec), data, len);
+  }
+  memset(p + sizeof(rec) + len, 0, CAPTURE_ALIGN(len) - len);
+  _offs += n;
+  return true;
+}
+
+CaptureReader::~CaptureReader() {
+  close();
+}
+
+bool CaptureReader::open(const char* path) {
+  close();
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    int e = errno;
+    ::close(fd);
+    errno = e;
+    return false;
+  }
+  if ((size_t)st.st_size < sizeof(CaptureHeader)) {
+    ::close(fd);
+    errno = EINVAL;
+    return false;
+  }
+  void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+  madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+  madvise(p, (size_t)st.st_size, MADV_WILLNEED);
+  _data = (const char*)p;
+  _size = (size_t)st.st_size;
+  if (memcmp(header().magic, CAPTURE_MAGIC, 4) != 0 || header().version != CAPTURE_VERSION) {
+    close();
+    errno = EINVAL;
+    return false;
+  }
+  rewind();
+  return true;
+}
+
+void CaptureReader::close() {
+  if (_data != nullptr) {
+    munmap((void*)_data, _size);
+    _data = nullptr;
+    _size = 0;
+  }
+}
+
+bool CaptureReader::next(const CaptureRecord** rec, const char** payload) {
+  if (_size - _offs < sizeof(CaptureRecord)) {
+    return false;
+  }
+  const CaptureRecord* r = (const CaptureRecord*)(_data + _offs);
+  if (r->type == 0) {
+    return false; // zero fill at the end of a capture that wasn't closed (see CaptureWriter)
+  }
+  size_t n = sizeof(CaptureRecord) + CAPTURE_ALIGN((size_t)r->len);
+  if (_size - _offs < n) {
+    return false;
+  }
+  *rec = r;
+  *payload = _data + _offs + sizeof(CaptureRecord);
+  _offs += n;
+  return true;
+}
+
+void CaptureReader::rewind() {
+  _offs = sizeof(CaptureHeader);
+}
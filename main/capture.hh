@@ -0,0 +1,107 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// A capture file records what a client sent to the server, with timing, so that it can be
+// replayed into a WireServer without the client (see replay.cc). It consists of a
+// CaptureHeader followed by records: a CaptureRecord and len bytes of payload, padded to
+// a multiple of 8 bytes. Numbers are in host byte order.
+//
+// Payloads by type:
+//   CAPTURE_DAWNCMD      Dawn command data, as passed to onDawnBuffer
+//   CAPTURE_FRAME_END    none
+//   CAPTURE_RESERVATION  a dawn_wire::ReservedSwapChain
+//   CAPTURE_SHM          a CaptureShm (the memory's contents are not captured)
+#define CAPTURE_MAGIC "DWC1"
+#define CAPTURE_VERSION 1
+
+enum CaptureType : uint8_t {
+  CAPTURE_DAWNCMD = 1,
+  CAPTURE_FRAME_END = 2,
+  CAPTURE_RESERVATION = 3,
+  CAPTURE_SHM = 4,
+};
+
+struct CaptureHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t startTime; // CLOCK_REALTIME in nanoseconds when the capture started
+};
+
+struct CaptureRecord {
+  uint64_t time; // nanoseconds since the capture started
+  uint32_t len;  // payload size
+  uint8_t type;  // CaptureType
+  uint8_t _pad[3];
+};
+
+struct CaptureShm {
+  uint32_t id;
+  uint32_t _pad;
+  uint64_t size;
+};
+
+// CaptureWriter appends records to a capture file through a memory mapping of its end,
+// which is moved along in steps of CAPTURE_MAP_SIZE, so adding a record is mostly a
+// memcpy into the page cache. The file is only trimmed to the records written by close.
+// Not thread safe.
+#define CAPTURE_MAP_SIZE (16 * 1024 * 1024)
+
+class CaptureWriter {
+public:
+  ~CaptureWriter();
+
+  // open creates (or truncates) the file at path. Returns false on error (errno is set.)
+  bool open(const char* path);
+
+  // close trims the file to the size of the records written and closes it
+  void close();
+
+  // add appends a record. On error, capturing stops and false is returned.
+  bool add(CaptureType type, const void* data, size_t len);
+
+  bool isOpen() const {
+    return _fd != -1;
+  }
+  uint64_t size() const {
+    return _offs;
+  }
+
+private:
+  char* reserve(size_t n);
+
+  int _fd = -1;
+  uint64_t _start = 0;    // metricsNow() at open
+  uint64_t _offs = 0;     // file size in use
+  char* _map = nullptr;   // mapping of the file from _mapBase
+  uint64_t _mapBase = 0;  // page aligned
+  size_t _mapLen = 0;
+};
+
+// CaptureReader reads the records of a capture file, which it maps into memory
+class CaptureReader {
+public:
+  ~CaptureReader();
+
+  // open maps the file at path. Returns false if it can't be read or isn't a capture file.
+  bool open(const char* path);
+  void close();
+
+  const CaptureHeader& header() const {
+    return *(const CaptureHeader*)_data;
+  }
+
+  // next returns the next record and points *payload at its payload.
+  // Returns false at the end of the file, at a truncated record, or where the records
+  // end in a capture whose writer was never closed (e.g. the server crashed), which is
+  // followed by up to CAPTURE_MAP_SIZE bytes of zeros.
+  bool next(const CaptureRecord** rec, const char** payload);
+
+  // rewind goes back to the first record
+  void rewind();
+
+private:
+  const char* _data = nullptr;
+  size_t _size = 0;
+  size_t _offs = 0;
+};
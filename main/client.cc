@@ -15,6 +15,8 @@
 #define DLOG_PREFIX "\e[1;36m[client]\e[0m "
 
 #include "common.hh"
+#include "compute.hh"
+#include "memtransfer.hh"
 #include "protocol.hh"
 
 #include <dawn/common/Assert.h>
@@ -22,12 +24,14 @@
 #include <dawn/webgpu.h>
 #include <dawn/wire/WireClient.h>
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
 
 #include <unistd.h> // pipe
 
-std::string cWGSL = R"(@group(0) @binding(0) var<storage,read> inputBuffer: array<f32,64>;
-@group(0) @binding(1) var<storage,read_write> outputBuffer: array<f32,64>;
+std::string cWGSL = R"(@group(0) @binding(0) var<storage,read> inputBuffer: array<f32>;
+@group(0) @binding(1) var<storage,read_write> outputBuffer: array<f32>;
 
 // The function to evaluate for each element of the processed buffer
 fn f(x: f32) -> f32 {
@@ -37,28 +41,190 @@ fn f(x: f32) -> f32 {
 @compute @workgroup_size(32)
 fn computeStuff(@builtin(global_invocation_id) id: vec3<u32>) {
     // Apply the function f to the buffer element at index id.x:
-    outputBuffer[id.x] = f(inputBuffer[id.x]);
+    if (id.x < arrayLength(&outputBuffer)) {
+        outputBuffer[id.x] = f(inputBuffer[id.x]);
+    }
 }
 )";
 
-inline constexpr auto m_bufferSize = 64 * sizeof(float);
-
-int connectUNIXSocket(const char* filename) {
-  /*struct*/ sockaddr_un addr;
-  int fd = createUNIXSocket(filename, &addr);
-  if (fd > -1) {
-    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-      int e = errno;
-      close(fd);
-      errno = e;
-      fd = -1;
+#define NUM_JOBS 8
+#define JOB_SIZE 64 /* floats in job 0; job N has (N+1)*JOB_SIZE */
+
+#define TICK_INTERVAL_MIN 0.00005 /* 50us */
+#define TICK_INTERVAL_MAX 0.002   /* 2ms */
+
+struct Connection;
+wgpu::Adapter requestAdapter(wgpu::Instance instance, wgpu::RequestAdapterOptions const* options,
+                             Connection& conn);
+
+struct Connection {
+  DawnRemoteProtocol proto;
+  ShmTransferClient memTransfer{proto};
+
+  dawn_wire::WireClient* wireClient = nullptr;
+  wgpu::Device device;
+  wgpu::Instance instance;
+
+  dawn_wire::ReservedInstance instanceReservation;
+  std::unique_ptr<ComputeRunner> compute;
+
+  // Outstanding async operations (adapter & device requests, buffer mapping, ...).
+  // Their results only arrive once the server has ticked the device, so while any are
+  // pending and there is a device, tickTimer sends device ticks, backing off from
+  // TICK_INTERVAL_MIN to TICK_INTERVAL_MAX. With nothing pending the timer is stopped and
+  // the event loop sleeps until the server sends something.
+  RunLoop* rl = nullptr;
+  uint32_t pending = 0;
+  ev_timer tickTimer;
+  double tickInterval = TICK_INTERVAL_MIN;
+
+  // beginAsync must be called when starting an async operation and endAsync from its
+  // callback
+  void beginAsync() {
+    pending++;
+    tickInterval = TICK_INTERVAL_MIN;
+    if (!ev_is_active(&tickTimer)) {
+      scheduleTick(0.);
+    }
+  }
+
+  void endAsync() {
+    assert(pending > 0);
+    if (--pending == 0) {
+      ev_timer_stop(rl, &tickTimer);
+    } else {
+      tickInterval = TICK_INTERVAL_MIN; // the server is making progress
+    }
+  }
+
+  void scheduleTick(double after) {
+    if (pending == 0 || !device) {
+      return; // requests without a device are answered without ticking
     }
+    ev_timer_stop(rl, &tickTimer);
+    ev_timer_set(&tickTimer, after, 0.);
+    ev_timer_start(rl, &tickTimer);
+  }
+
+  static void onTickTimer(RunLoop* rl, ev_timer* w, int revents) {
+    Connection* conn = (Connection*)w->data;
+    conn->device.Tick();
+    conn->proto.Flush();
+    double interval = conn->tickInterval;
+    conn->tickInterval = std::min(interval * 2, TICK_INTERVAL_MAX);
+    conn->scheduleTick(interval);
   }
-  return fd;
+
+  Connection() {
+    ev_timer_init(&tickTimer, onTickTimer, 0., 0.);
+    tickTimer.data = this;
+  }
+
+  ~Connection() {
+    if (rl != nullptr) {
+      ev_timer_stop(rl, &tickTimer);
+    }
+    // prevent double free by releasing refs to things that the wireClient owns
+    if (wireClient) {
+      compute.reset();
+      device.Release();
+      instance.Release();
+      delete wireClient;
+    }
+  }
+
+  void initDawnWire() {
+    DawnProcTable procs = dawn_wire::client::GetProcs();
+    // procs.deviceSetUncapturedErrorCallback(device.Get(), printDeviceError, nullptr);
+    dawnProcSetProcs(&procs);
+
+    dawn_wire::WireClientDescriptor clientDesc = {};
+    // buffer mapping data is transferred via shared memory rather than the command stream
+    clientDesc.serializer = &proto;
+    clientDesc.memoryTransferService = &memTransfer;
+    wireClient = new dawn_wire::WireClient(clientDesc); // global var
+
+    instanceReservation = wireClient->ReserveInstance();
+    instance = wgpu::Instance::Acquire(instanceReservation.instance);
+
+    wgpu::RequestAdapterOptions adapterOpts = {};
+    adapterOpts.nextInChain = nullptr;
+    // the adapter and device arrive asynchronously; see requestAdapter's callbacks
+    requestAdapter(instance, &adapterOpts, *this);
+  }
+
+  // invoked before starting event loop
+  bool start(RunLoop* rl_, int fd) {
+    if (!proto.start(rl_, fd)) {
+      return false;
+    }
+    rl = rl_;
+    initDawnWire();
+    return true;
+  }
+};
+
+
+// runJobs runs NUM_JOBS jobs of different sizes in one batch and leaves the event loop when
+// all of them are done
+void runJobs(Connection& conn) {
+  conn.compute = std::make_unique<ComputeRunner>(conn.device);
+  ComputeRunner& compute = *conn.compute;
+  compute.onAsyncBegin = [&]() { conn.beginAsync(); };
+  compute.onAsyncEnd = [&]() { conn.endAsync(); };
+
+  uint32_t kernel = compute.registerKernel(cWGSL.c_str(), "computeStuff", 32);
+  if (kernel == 0) {
+    errlog("failed to register kernel");
+    ev_break(conn.rl, EVBREAK_ALL);
+    return;
+  }
+
+  auto ndone = std::make_shared<uint32_t>(0);
+  for (uint32_t job = 0; job < NUM_JOBS; job++) {
+    auto input = std::make_shared<std::vector<float>>((job + 1) * JOB_SIZE);
+    for (size_t i = 0; i < input->size(); ++i) {
+      (*input)[i] = 0.1f * i;
+    }
+    size_t size = input->size() * sizeof(float);
+    bool ok = compute.submit({
+      .kernel = kernel,
+      .input = input->data(),
+      .inputSize = size,
+      .outputSize = size,
+      .done =
+        [&conn, job, input, ndone](bool ok, const void* data, size_t) {
+          const float* output = (const float*)data;
+          if (!ok) {
+            errlog("job %u failed", job);
+          } else if (job == 0) {
+            for (size_t i = 0; i < input->size(); ++i) {
+              std::cout << "input " << (*input)[i] << " became " << output[i] << std::endl;
+            }
+          } else {
+            size_t nbad = 0;
+            for (size_t i = 0; i < input->size(); ++i) {
+              nbad += output[i] != 2.0f * (*input)[i] + 1.0f;
+            }
+            dlog("job %u: %zu values, %zu wrong", job, input->size(), nbad);
+          }
+          if (++*ndone == NUM_JOBS) {
+            const BufferPool::Stats& ps = conn.compute->pool.stats();
+            dlog("buffer pool: %llu created, %llu reused, %zu bytes idle",
+                 (unsigned long long)ps.creates, (unsigned long long)ps.reuses, ps.bytesIdle);
+            ev_break(conn.rl, EVBREAK_ALL); // done
+          }
+        },
+    });
+    if (!ok) {
+      errlog("failed to submit job %u", job);
+    }
+  }
+  compute.flush();
 }
 
 wgpu::Adapter requestAdapter(wgpu::Instance instance, wgpu::RequestAdapterOptions const* options,
-                             DawnRemoteProtocol& proto) {
+                             Connection& conn) {
   // A simple structure holding the local information shared with the
   // onAdapterRequestEnded callback.
   struct UserData {
@@ -80,7 +246,8 @@ wgpu::Adapter requestAdapter(wgpu::Instance instance, wgpu::RequestAdapterOption
   wgpu::RequestAdapterCallback onAdapterRequestEnded = [](WGPURequestAdapterStatus status,
                                                           WGPUAdapter adapter, char const* message,
                                                           void* pUserData) {
-    DawnRemoteProtocol& proto = *reinterpret_cast<DawnRemoteProtocol*>(pUserData);
+    Connection& conn = *reinterpret_cast<Connection*>(pUserData);
+    conn.endAsync();
     wgpu::Adapter wAdapter;
     if ((wgpu::RequestAdapterStatus)status == wgpu::RequestAdapterStatus::Success) {
       wAdapter = (wgpu::Adapter)adapter;
@@ -111,15 +278,18 @@ wgpu::Adapter requestAdapter(wgpu::Instance instance, wgpu::RequestAdapterOption
             adapterTypeName(p.adapterType));
 
     wgpu::DeviceDescriptor desc{};
+    conn.beginAsync();
     wAdapter.RequestDevice(
         &desc,
         [](WGPURequestDeviceStatus status, WGPUDevice cDevice, const char* message,
            void* pUserData) {
           assert(status == WGPURequestDeviceStatus_Success);
-          DawnRemoteProtocol& proto = *reinterpret_cast<DawnRemoteProtocol*>(pUserData);
+          Connection& conn = *reinterpret_cast<Connection*>(pUserData);
+          conn.endAsync();
 
           dlog("got webgpu device");
           auto device = wgpu::Device::Acquire(cDevice);
+          conn.device = device;
           device.SetUncapturedErrorCallback(printDeviceError, nullptr);
           device.SetLoggingCallback(printDeviceLog, nullptr);
           device.SetDeviceLostCallback(printDeviceLostCallback, nullptr);
@@ -127,329 +297,42 @@ wgpu::Adapter requestAdapter(wgpu::Instance instance, wgpu::RequestAdapterOption
           size_t count = device.EnumerateFeatures(nullptr);
           dlog("device number of features: %lu", count);
 
-          // setup compute
-
-          // Create bind group layout
-          std::vector<wgpu::BindGroupLayoutEntry> bindings(2);
-
-          // Input buffer
-          bindings[0].binding = 0;
-          bindings[0].buffer.type = wgpu::BufferBindingType::ReadOnlyStorage;
-          bindings[0].visibility = wgpu::ShaderStage::Compute;
-
-          // Output buffer
-          bindings[1].binding = 1;
-          bindings[1].buffer.type = wgpu::BufferBindingType::Storage;
-          bindings[1].visibility = wgpu::ShaderStage::Compute;
-
-          wgpu::BindGroupLayoutDescriptor bindGroupLayoutDesc;
-          bindGroupLayoutDesc.entryCount = (uint32_t)bindings.size();
-          bindGroupLayoutDesc.entries = bindings.data();
-          auto m_bindGroupLayout = device.CreateBindGroupLayout(&bindGroupLayoutDesc);
-
-          // Load compute shader
-          wgpu::ShaderModuleWGSLDescriptor shaderCodeDesc{};
-          shaderCodeDesc.nextInChain = nullptr;
-          shaderCodeDesc.sType = wgpu::SType::ShaderModuleWGSLDescriptor;
-          wgpu::ShaderModuleDescriptor shaderDesc{};
-          shaderDesc.nextInChain = &shaderCodeDesc;
-          shaderCodeDesc.code = cWGSL.c_str();
-
-          wgpu::ShaderModule computeShaderModule = device.CreateShaderModule(&shaderDesc);
-
-          // Create compute pipeline layout
-          wgpu::PipelineLayoutDescriptor pipelineLayoutDesc;
-          pipelineLayoutDesc.bindGroupLayoutCount = 1;
-          pipelineLayoutDesc.bindGroupLayouts = &m_bindGroupLayout;
-          auto m_pipelineLayout = device.CreatePipelineLayout(&pipelineLayoutDesc);
-
-          // Create compute pipeline
-          wgpu::ComputePipelineDescriptor computePipelineDesc;
-          computePipelineDesc.compute.constantCount = 0;
-          computePipelineDesc.compute.constants = nullptr;
-          computePipelineDesc.compute.entryPoint = "computeStuff";
-          computePipelineDesc.compute.module = computeShaderModule;
-          computePipelineDesc.layout = m_pipelineLayout;
-          auto m_pipeline = device.CreateComputePipeline(&computePipelineDesc);
-
-          // Create input/output buffers
-          wgpu::BufferDescriptor bufferDesc;
-          bufferDesc.mappedAtCreation = false;
-          bufferDesc.size = m_bufferSize;
-
-          bufferDesc.usage = wgpu::BufferUsage::Storage | wgpu::BufferUsage::CopyDst;
-          auto m_inputBuffer = device.CreateBuffer(&bufferDesc);
-
-          bufferDesc.usage = wgpu::BufferUsage::Storage | wgpu::BufferUsage::CopySrc;
-          auto m_outputBuffer = device.CreateBuffer(&bufferDesc);
-
-          // Create an intermediary buffer to which we copy the output and that can be
-          // used for reading into the CPU memory.
-          bufferDesc.usage = wgpu::BufferUsage::CopyDst | wgpu::BufferUsage::MapRead;
-          auto m_mapBuffer = device.CreateBuffer(&bufferDesc);
-
-          // Create compute bind group
-          std::vector<wgpu::BindGroupEntry> entries(2);
-
-          // Input buffer
-          entries[0].binding = 0;
-          entries[0].buffer = m_inputBuffer;
-          entries[0].offset = 0;
-          entries[0].size = m_bufferSize;
-
-          // Output buffer
-          entries[1].binding = 1;
-          entries[1].buffer = m_outputBuffer;
-          entries[1].offset = 0;
-          entries[1].size = m_bufferSize;
-
-          wgpu::BindGroupDescriptor bindGroupDesc;
-          bindGroupDesc.layout = m_bindGroupLayout;
-          bindGroupDesc.entryCount = (uint32_t)entries.size();
-          bindGroupDesc.entries = entries.data();
-          auto m_bindGroup = device.CreateBindGroup(&bindGroupDesc);
-
-          // OnCompute
-          auto queue = device.GetQueue();
-          std::vector<float> input(m_bufferSize / sizeof(float));
-          for (int i = 0; i < input.size(); ++i) {
-            input[i] = 0.1f * i;
-          }
-          queue.WriteBuffer(m_inputBuffer, 0, input.data(), input.size() * sizeof(float));
-
-          // Initialize a command encoder
-          wgpu::CommandEncoderDescriptor encoderDesc = {};
-          wgpu::CommandEncoder encoder = device.CreateCommandEncoder(&encoderDesc);
-
-          // Create compute pass
-          wgpu::ComputePassDescriptor computePassDesc;
-          computePassDesc.timestampWriteCount = 0;
-          computePassDesc.timestampWrites = nullptr;
-          wgpu::ComputePassEncoder computePass = encoder.BeginComputePass(&computePassDesc);
-
-          // Use compute pass
-          computePass.SetPipeline(m_pipeline);
-          computePass.SetBindGroup(0, m_bindGroup, 0, nullptr);
-
-          uint32_t invocationCount = m_bufferSize / sizeof(float);
-          uint32_t workgroupSize = 32;
-          // This ceils invocationCount / workgroupSize
-          uint32_t workgroupCount = (invocationCount + workgroupSize - 1) / workgroupSize;
-          computePass.DispatchWorkgroups(workgroupCount, 1, 1);
-
-          // Finalize compute pass
-          computePass.End();
-
-          // Before encoder.finish
-          encoder.CopyBufferToBuffer(m_outputBuffer, 0, m_mapBuffer, 0, m_bufferSize);
-
-          // Encode and submit the GPU commands
-          wgpu::CommandBufferDescriptor cmdDesc{};
-          wgpu::CommandBuffer commands = encoder.Finish(&cmdDesc);
-          queue.Submit(1, &commands);
-          dlog("submitted queue");
-
-          // Print output
-          struct MapAsyncUserData {
-            wgpu::Buffer buf;
-            DawnRemoteProtocol& proto;
-            std::vector<float> input;
-            wgpu::Device device;
-          };
-
-          auto ctx = new MapAsyncUserData{std::move(m_mapBuffer), proto, std::move(input),
-                                          std::move(device)};
-
-          ctx->buf.MapAsync(
-              wgpu::MapMode::Read, 0, m_bufferSize,
-              [](WGPUBufferMapAsyncStatus status, void* userdata) {
-                dlog("MapAsync callback");
-                // Leak here, but we need device to live long enough for the error callbacks to be
-                // called
-                // auto c =
-                //    std::unique_ptr<MapAsyncUserData>(static_cast<MapAsyncUserData*>(userdata));
-                auto c = static_cast<MapAsyncUserData*>(userdata);
-                if (status == WGPUBufferMapAsyncStatus_Success) {
-                  const float* output = (const float*)c->buf.GetConstMappedRange(0, m_bufferSize);
-                  for (int i = 0; i < c->input.size(); ++i) {
-                    std::cout << "input " << c->input[i] << " became " << output[i] << std::endl;
-                  }
-                  c->buf.Unmap();
-                } else {
-                  dlog("MapAsync callback not successful: %i", status);
-                }
-              },
-              ctx);
-          dlog("will flush");
-          proto.Flush();
-          dlog("flushed once");
-          ctx->device.Tick();
-          dlog("ticked once");
-          proto.Flush();
-          dlog("flushed twice");
-          ctx->device.Tick();
-          dlog("ticked twice");
-          proto.Flush();
-
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
-          dlog("flushed");
-          ctx->device.Tick();
-          dlog("ticked");
-          proto.Flush();
+          runJobs(conn);
+          conn.proto.Flush();
         },
-        (void*)&proto);
-    proto.Flush();
+        (void*)&conn);
+    conn.proto.Flush();
   };
 
   // Call to the WebGPU request adapter procedure
-  instance.RequestAdapter(options, onAdapterRequestEnded, (void*)&proto);
-  proto.Flush();
+  conn.beginAsync();
+  instance.RequestAdapter(options, onAdapterRequestEnded, (void*)&conn);
+  conn.proto.Flush();
 
-  // In theory we should wait until onAdapterReady has been called, which
-  // could take some time (what the 'await' keyword does in the JavaScript
-  // code). In practice, we know that when the wgpuInstanceRequestAdapter()
-  // function returns its callback has been called.
-
-  // TODO: Actually, now that we're using dawn wire this is not guaranteed and
-  // is failing. Also need to InjectInstance from the server side with the correct
-  // (id, generation)
-  // assert(userData.requestEnded);
+  // With dawn wire the callback is called later, from the event loop, when the
+  // server's reply arrives.
 
   return userData.adapter;
 }
 
-struct Connection {
-  DawnRemoteProtocol proto;
-
-  dawn_wire::WireClient* wireClient = nullptr;
-  wgpu::Device device;
-  wgpu::Instance instance;
-
-  dawn_wire::ReservedInstance instanceReservation;
-
-  ~Connection() {
-    // prevent double free by releasing refs to things that the wireClient owns
-    if (wireClient) {
-      device.Release();
-      instance.Release();
-      delete wireClient;
-    }
-  }
-
-  void initDawnWire() {
-    DawnProcTable procs = dawn_wire::client::GetProcs();
-    // procs.deviceSetUncapturedErrorCallback(device.Get(), printDeviceError, nullptr);
-    dawnProcSetProcs(&procs);
-
-    dawn_wire::WireClientDescriptor clientDesc = {};
-    // serializer is configured here, optional memory transfer service
-    // is not configured at this time
-    clientDesc.serializer = &proto;
-    wireClient = new dawn_wire::WireClient(clientDesc); // global var
-
-    instanceReservation = wireClient->ReserveInstance();
-    instance = wgpu::Instance::Acquire(instanceReservation.instance);
-
-    wgpu::RequestAdapterOptions adapterOpts = {};
-    adapterOpts.nextInChain = nullptr;
-    auto adapter = requestAdapter(instance, &adapterOpts, proto);
-  }
-
-  // invoked before starting event loop
-  void start(RunLoop* rl, int fd) {
-    proto.start(rl, fd);
-    initDawnWire();
-  }
-};
-
 // called by main function. Sets up Connection object, proto callbacks
 // and event loop, runs event loop until exit
-// 3 callbacks are used: onFrame, onDawnBuffer and onFramebufferInfo
-void runloop_main(int fd) {
+// 2 callbacks are used: onDawnBuffer and onFramebufferInfo
+void runloop_main(int fd, bool tcp) {
   RunLoop* rl = EV_DEFAULT;
   FDSetNonBlock(fd);
 
   Connection conn;
 
-  conn.proto.onFrame = [&]() {
-    dlog("render frame()");
-    return;
-  };
+  // for ShmTransferClient; over TCP, buffer data is transferred inline instead
+  conn.proto.fdPassing = !tcp;
+  // Compression costs more CPU than it saves on a local socket; opt in for remote servers
+  if (getenv("DAWN_REMOTE_COMPRESS") != nullptr) {
+    conn.proto.features |= DawnRemoteProtocol::FeatureCompression;
+  }
+
+  // This example doesn't render, so it doesn't set onFrame: no frames are started and the
+  // event loop sleeps while nothing is pending (frame pacing is exercised by transportbench)
 
   conn.proto.onDawnBuffer = [&](const char* data, size_t len) {
     dlog("onDawnBuffer len=%zu", len);
@@ -463,24 +346,37 @@ void runloop_main(int fd) {
     dlog("onFramebufferInfo %ux%u", fbinfo.width, fbinfo.height);
   };
 
-  conn.start(rl, fd);
+  if (!conn.start(rl, fd)) {
+    perror("Connection::start");
+    return;
+  }
   ev_run(rl, 0);
   dlog("exit runloop");
 }
 
 int main(int argc, const char* argv[]) {
   bool first_retry = true;
-  const char* sockfile = SERVER_SOCK;
+  const char* serverAddr = SERVER_SOCK;
+  if (argc > 1) {
+    serverAddr = argv[1];
+  } else if (const char* s = getenv("DAWN_SERVER_ADDR")) {
+    serverAddr = s;
+  }
+  SockAddr addr;
+  if (!parseSockAddr(serverAddr, &addr)) {
+    errlog("invalid address \"%s\"", serverAddr);
+    return 1;
+  }
   int fd;
   while (1) {
     if (first_retry) {
-      dlog("connecting to UNIX socket \"%s\" ...", sockfile);
+      dlog("connecting to %s ...", fmtSockAddr(addr).c_str());
       first_retry = false;
     }
-    fd = connectUNIXSocket(sockfile);
+    fd = connectSocket(addr);
     if (fd < 0) {
       if (errno != ECONNREFUSED && errno != ENOENT) {
-        perror("connectUNIXSocket");
+        perror("connectSocket");
       }
       sleep(1);
       continue;
@@ -489,7 +385,7 @@ int main(int argc, const char* argv[]) {
     break;
   }
   dlog("connected to socket");
-  runloop_main(fd);
+  runloop_main(fd, addr.tcp);
   close(fd);
 
   dlog("exit");
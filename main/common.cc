@@ -1,19 +1,10 @@
 #include "common.hh"
-#include <ev.h>
 #include <optional>
 
-const char* tmptimestamp() {
-  time_t now = time(NULL);
-  struct tm* tm_info = localtime(&now);
-  static char buf[16]; // HH:MM:SS.nnnnnn\0
-  int buftimeoffs = strftime(buf, sizeof(buf), "%H:%M:%S", tm_info);
-  // .mmm
-  double t = ev_time();
-  double ms = (t - std::floor(t)) * 1000000.0;
-  int n = snprintf(&buf[buftimeoffs], sizeof(buf) - buftimeoffs, ".%06u", (uint32_t)ms);
-  buf[n + buftimeoffs] = 0;
-  return buf;
-}
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
 
 bool FDSetNonBlock(int fd) {
   int flags = fcntl(fd, F_GETFL);
@@ -37,6 +28,141 @@ int createUNIXSocket(const char* filename, sockaddr_un* addr) {
   return socket(AF_UNIX, SOCK_STREAM, 0);
 }
 
+bool parseSockAddr(const char* s, SockAddr* addr) {
+  std::string str = s;
+  if (str.compare(0, 5, "unix:") == 0) {
+    addr->tcp = false;
+    addr->path = str.substr(5);
+    return !addr->path.empty();
+  }
+  if (str.compare(0, 4, "tcp:") == 0) {
+    str = str.substr(4);
+  } else if (str.find('/') != std::string::npos) {
+    addr->tcp = false;
+    addr->path = str;
+    return true;
+  }
+  size_t colon = str.rfind(':');
+  if (colon == std::string::npos || colon + 1 == str.size()) {
+    return false;
+  }
+  addr->tcp = true;
+  addr->host = str.substr(0, colon);
+  addr->port = str.substr(colon + 1);
+  if (addr->host.size() >= 2 && addr->host.front() == '[' && addr->host.back() == ']') {
+    addr->host = addr->host.substr(1, addr->host.size() - 2);
+  }
+  return true;
+}
+
+std::string fmtSockAddr(const SockAddr& addr) {
+  if (!addr.tcp) {
+    return "unix:" + addr.path;
+  }
+  if (addr.host.find(':') != std::string::npos) {
+    return "tcp:[" + addr.host + "]:" + addr.port;
+  }
+  return "tcp:" + addr.host + ":" + addr.port;
+}
+
+bool tuneTCPSocket(int fd) {
+  int one = 1;
+  int bufsize = SOCK_BUFSIZE;
+  int keepidle = 30; // seconds of idle before the first probe
+  int keepintvl = 10;
+  int keepcnt = 3;
+#if defined(TCP_KEEPIDLE)
+  int keepidleopt = TCP_KEEPIDLE;
+#elif defined(TCP_KEEPALIVE)
+  int keepidleopt = TCP_KEEPALIVE; // macOS
+#endif
+  return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0 &&
+         setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)) == 0 &&
+         setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)) == 0 &&
+         setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)) == 0 &&
+#if defined(TCP_KEEPIDLE) || defined(TCP_KEEPALIVE)
+         setsockopt(fd, IPPROTO_TCP, keepidleopt, &keepidle, sizeof(keepidle)) == 0 &&
+#endif
+         setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl)) == 0 &&
+         setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt)) == 0;
+}
+
+// tcpSocket creates a socket for addr and binds or connects it
+static int tcpSocket(const SockAddr& addr, bool server) {
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = server ? AI_PASSIVE : 0;
+  struct addrinfo* res;
+  const char* host = addr.host.empty() || addr.host == "*" ? nullptr : addr.host.c_str();
+  int err = getaddrinfo(host, addr.port.c_str(), &hints, &res);
+  if (err != 0) {
+    errno = err == EAI_SYSTEM ? errno : EADDRNOTAVAIL;
+    return -1;
+  }
+  int fd = -1;
+  for (struct addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    int one = 1;
+    // set up before listen/connect so that the window scale covers the buffer size
+    bool ok = tuneTCPSocket(fd);
+    if (ok && server) {
+      ok = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0 &&
+           bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0;
+    } else if (ok) {
+      ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+    }
+    if (ok) {
+      break;
+    }
+    int e = errno;
+    close(fd);
+    errno = e;
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+int listenSocket(const SockAddr& addr) {
+  if (addr.tcp) {
+    return tcpSocket(addr, true);
+  }
+  sockaddr_un sa;
+  int fd = createUNIXSocket(addr.path.c_str(), &sa);
+  if (fd > -1) {
+    unlink(addr.path.c_str());
+    if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1 || listen(fd, SOMAXCONN) == -1) {
+      int e = errno;
+      close(fd);
+      unlink(addr.path.c_str());
+      errno = e;
+      fd = -1;
+    }
+  }
+  return fd;
+}
+
+int connectSocket(const SockAddr& addr) {
+  if (addr.tcp) {
+    return tcpSocket(addr, false);
+  }
+  sockaddr_un sa;
+  int fd = createUNIXSocket(addr.path.c_str(), &sa);
+  if (fd > -1) {
+    if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+      int e = errno;
+      close(fd);
+      errno = e;
+      fd = -1;
+    }
+  }
+  return fd;
+}
+
 const char* backendTypeName(wgpu::BackendType t) {
   switch (t) {
   case wgpu::BackendType::Null:
@@ -5,38 +5,38 @@
 #include <fcntl.h> // F_GETFL, O_NONBLOCK etc
 #include <iostream>
 #include <optional>
+#include <string>
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <time.h> // strftime
 
-#ifdef DEBUG
-#define dlog(format, ...)                                                                          \
-  ({                                                                                               \
-    fprintf(stderr, "%s " DLOG_PREFIX format " \e[2m(%s %d)\e[0m\n", tmptimestamp(),               \
-            ##__VA_ARGS__, __FUNCTION__, __LINE__);                                                \
-    fflush(stderr);                                                                                \
-  })
-#define errlog(format, ...)                                                                        \
-  (({                                                                                              \
-    fprintf(stderr, "E " format " (%s:%d)\n", ##__VA_ARGS__, __FILE__, __LINE__);                  \
-    fflush(stderr);                                                                                \
-  }))
-#else
-#define dlog(...)                                                                                  \
-  do {                                                                                             \
-  } while (0)
-#define errlog(format, ...)                                                                        \
-  (({                                                                                              \
-    fprintf(stderr, "E " format "\n", ##__VA_ARGS__);                                              \
-    fflush(stderr);                                                                                \
-  }))
-#endif
+#include "log.hh" // dlog, errlog
 
 #define SERVER_SOCK "/tmp/server.sock"
 
-const char* tmptimestamp();
+// SockAddr is a transport address: "unix:PATH" or "tcp:HOST:PORT". Without a prefix,
+// an address containing a '/' is a UNIX socket path and anything else is HOST:PORT.
+// HOST may be a name, an IPv4 address or an IPv6 address in brackets.
+struct SockAddr {
+  bool tcp = false;
+  std::string path; // UNIX
+  std::string host; // TCP
+  std::string port; // TCP
+};
+
+// SOCK_BUFSIZE is the send and receive buffer size of TCP sockets
+#define SOCK_BUFSIZE (4 * 1024 * 1024)
+
 bool FDSetNonBlock(int fd);
 int createUNIXSocket(const char* filename, sockaddr_un* addr);
+bool parseSockAddr(const char* s, SockAddr* addr);
+std::string fmtSockAddr(const SockAddr& addr);
+// listenSocket and connectSocket return a socket file descriptor, or -1 with errno set.
+// TCP sockets are set up with tuneTCPSocket.
+int listenSocket(const SockAddr& addr);
+int connectSocket(const SockAddr& addr);
+// tuneTCPSocket disables Nagle's algorithm, sets the buffer sizes to SOCK_BUFSIZE and
+// enables keepalive, so that dead peers are noticed within about a minute.
+bool tuneTCPSocket(int fd);
 const char* backendTypeName(wgpu::BackendType t);
 const char* adapterTypeName(wgpu::AdapterType t);
 void printDeviceError(WGPUErrorType errorType, const char* message, void*);
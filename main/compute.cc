@@ -0,0 +1,190 @@
+#define DLOG_PREFIX "\e[1;36m[compute]\e[0m "
+
+#include "compute.hh"
+#include "common.hh"
+
+#define MAX_WORKGROUPS 65535 /* default maxComputeWorkgroupsPerDimension */
+
+#define INPUT_USAGE (wgpu::BufferUsage::Storage | wgpu::BufferUsage::CopyDst)
+#define OUTPUT_USAGE (wgpu::BufferUsage::Storage | wgpu::BufferUsage::CopySrc)
+#define READBACK_USAGE (wgpu::BufferUsage::CopyDst | wgpu::BufferUsage::MapRead)
+
+struct ComputeRunner::Running {
+  ComputeRunner* runner; // null once the runner is gone
+  uint32_t kernel;
+  uint32_t workgroups;
+  size_t inputSize;
+  size_t outputSize;
+  wgpu::Buffer input;
+  wgpu::Buffer output;
+  wgpu::Buffer readback;
+  wgpu::BindGroup bindGroup;
+  DoneCallback done;
+};
+
+ComputeRunner::~ComputeRunner() {
+  for (Running* r : _queued) {
+    releaseBuffers(r);
+    delete r;
+  }
+  for (Running* r : _running) {
+    r->runner = nullptr; // freed by onMapped
+  }
+}
+
+void ComputeRunner::releaseBuffers(Running* r) {
+  pool.release(std::move(r->input), r->inputSize, INPUT_USAGE);
+  pool.release(std::move(r->output), r->outputSize, OUTPUT_USAGE);
+  pool.release(std::move(r->readback), r->outputSize, READBACK_USAGE);
+}
+
+uint32_t ComputeRunner::registerKernel(const char* wgsl, const char* entryPoint,
+                                       uint32_t workgroupSize) {
+  if (workgroupSize == 0) {
+    return 0;
+  }
+  if (!_bindGroupLayout) {
+    wgpu::BindGroupLayoutEntry bindings[2] = {};
+    bindings[0].binding = 0;
+    bindings[0].buffer.type = wgpu::BufferBindingType::ReadOnlyStorage;
+    bindings[0].visibility = wgpu::ShaderStage::Compute;
+    bindings[1].binding = 1;
+    bindings[1].buffer.type = wgpu::BufferBindingType::Storage;
+    bindings[1].visibility = wgpu::ShaderStage::Compute;
+    wgpu::BindGroupLayoutDescriptor bindGroupLayoutDesc;
+    bindGroupLayoutDesc.entryCount = 2;
+    bindGroupLayoutDesc.entries = bindings;
+    _bindGroupLayout = _device.CreateBindGroupLayout(&bindGroupLayoutDesc);
+
+    wgpu::PipelineLayoutDescriptor pipelineLayoutDesc;
+    pipelineLayoutDesc.bindGroupLayoutCount = 1;
+    pipelineLayoutDesc.bindGroupLayouts = &_bindGroupLayout;
+    _pipelineLayout = _device.CreatePipelineLayout(&pipelineLayoutDesc);
+  }
+
+  wgpu::ShaderModuleWGSLDescriptor shaderCodeDesc{};
+  shaderCodeDesc.sType = wgpu::SType::ShaderModuleWGSLDescriptor;
+  shaderCodeDesc.code = wgsl;
+  wgpu::ShaderModuleDescriptor shaderDesc{};
+  shaderDesc.nextInChain = &shaderCodeDesc;
+  wgpu::ShaderModule module = _device.CreateShaderModule(&shaderDesc);
+
+  wgpu::ComputePipelineDescriptor pipelineDesc;
+  pipelineDesc.layout = _pipelineLayout;
+  pipelineDesc.compute.module = module;
+  pipelineDesc.compute.entryPoint = entryPoint;
+  wgpu::ComputePipeline pipeline = _device.CreateComputePipeline(&pipelineDesc);
+  if (!pipeline) {
+    return 0;
+  }
+  _kernels.push_back(Kernel{std::move(pipeline), workgroupSize});
+  return (uint32_t)_kernels.size();
+}
+
+bool ComputeRunner::submit(const Job& job) {
+  if (job.kernel == 0 || job.kernel > _kernels.size() || job.inputSize == 0 ||
+      job.outputSize == 0 || job.inputSize % 4 != 0 || job.outputSize % 4 != 0) {
+    errlog("ComputeRunner::submit: invalid job");
+    return false;
+  }
+  if (_queued.size() + _running.size() >= maxJobsInFlight) {
+    return false;
+  }
+  uint32_t invocations = job.invocations != 0 ? job.invocations : job.outputSize / 4;
+  uint32_t workgroupSize = _kernels[job.kernel - 1].workgroupSize;
+  uint32_t workgroups = (invocations + workgroupSize - 1) / workgroupSize;
+  if (workgroups > MAX_WORKGROUPS) {
+    errlog("ComputeRunner::submit: too many invocations (%u)", invocations);
+    return false;
+  }
+
+  Running* r = new Running{this, job.kernel, workgroups, job.inputSize, job.outputSize};
+  r->input = pool.acquire(job.inputSize, INPUT_USAGE);
+  r->output = pool.acquire(job.outputSize, OUTPUT_USAGE);
+  r->readback = pool.acquire(job.outputSize, READBACK_USAGE);
+  if (!r->input || !r->output || !r->readback) {
+    releaseBuffers(r);
+    delete r;
+    return false;
+  }
+  r->done = job.done;
+
+  wgpu::BindGroupEntry entries[2] = {};
+  entries[0].binding = 0;
+  entries[0].buffer = r->input;
+  entries[0].size = job.inputSize;
+  entries[1].binding = 1;
+  entries[1].buffer = r->output;
+  entries[1].size = job.outputSize;
+  wgpu::BindGroupDescriptor bindGroupDesc;
+  bindGroupDesc.layout = _bindGroupLayout;
+  bindGroupDesc.entryCount = 2;
+  bindGroupDesc.entries = entries;
+  r->bindGroup = _device.CreateBindGroup(&bindGroupDesc);
+
+  // ordered before the Submit of the next flush
+  _queue.WriteBuffer(r->input, 0, job.input, job.inputSize);
+  _queued.push_back(r);
+  return true;
+}
+
+size_t ComputeRunner::flush() {
+  if (_queued.empty()) {
+    return 0;
+  }
+  wgpu::CommandEncoder encoder = _device.CreateCommandEncoder();
+  wgpu::ComputePassEncoder pass = encoder.BeginComputePass();
+  uint32_t kernel = 0;
+  for (Running* r : _queued) {
+    if (r->kernel != kernel) {
+      kernel = r->kernel;
+      pass.SetPipeline(_kernels[kernel - 1].pipeline);
+    }
+    pass.SetBindGroup(0, r->bindGroup, 0, nullptr);
+    pass.DispatchWorkgroups(r->workgroups, 1, 1);
+  }
+  pass.End();
+  for (Running* r : _queued) {
+    encoder.CopyBufferToBuffer(r->output, 0, r->readback, 0, r->outputSize);
+  }
+  wgpu::CommandBuffer commands = encoder.Finish();
+  _queue.Submit(1, &commands);
+
+  size_t n = _queued.size();
+  for (Running* r : _queued) {
+    _running.insert(r);
+    if (onAsyncBegin) {
+      onAsyncBegin();
+    }
+    r->readback.MapAsync(wgpu::MapMode::Read, 0, r->outputSize, onMapped, r);
+  }
+  _queued.clear();
+  dlog("dispatched %zu jobs (%zu running)", n, _running.size());
+  return n;
+}
+
+void ComputeRunner::onMapped(WGPUBufferMapAsyncStatus status, void* userdata) {
+  Running* r = (Running*)userdata;
+  ComputeRunner* runner = r->runner;
+  if (runner != nullptr) {
+    runner->_running.erase(r);
+    if (runner->onAsyncEnd) {
+      runner->onAsyncEnd();
+    }
+  }
+  bool ok = status == WGPUBufferMapAsyncStatus_Success;
+  if (!ok) {
+    dlog("job output mapping failed: %d", (int)status);
+  }
+  if (r->done) {
+    const void* output = ok ? r->readback.GetConstMappedRange(0, r->outputSize) : nullptr;
+    r->done(ok, output, ok ? r->outputSize : 0);
+  }
+  if (ok) {
+    r->readback.Unmap();
+  }
+  if (runner != nullptr) {
+    runner->releaseBuffers(r);
+  }
+  delete r;
+}
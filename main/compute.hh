@@ -0,0 +1,89 @@
+#pragma once
+#include "bufpool.hh"
+
+#include <dawn/webgpu_cpp.h>
+
+#include <deque>
+#include <functional>
+#include <unordered_set>
+#include <vector>
+
+// ComputeRunner runs compute jobs on a (remote) device.
+//
+// A kernel is registered once; its shader module and pipeline are reused by every job.
+// Kernels read a storage buffer at binding 0 and write a storage buffer at binding 1:
+//
+//   @group(0) @binding(0) var<storage,read> input: array<f32>;
+//   @group(0) @binding(1) var<storage,read_write> output: array<f32>;
+//
+// Jobs are queued with submit and sent with flush, which encodes all queued jobs in one
+// command encoder and submits it with a single queue.Submit. A job's done callback is
+// called with its output once the output has been mapped. Job buffers come from pool and
+// are returned to it when the job is done.
+//
+// Usage:
+//   ComputeRunner runner(device);
+//   uint32_t k = runner.registerKernel(wgsl, "main", 64);
+//   runner.submit({.kernel = k, .input = in, .inputSize = n, .outputSize = n,
+//                  .done = [](bool ok, const void* output, size_t size) { ... }});
+//   runner.flush();
+//
+class ComputeRunner {
+public:
+  // onAsyncBegin and onAsyncEnd are called when a buffer map is started and has completed
+  std::function<void()> onAsyncBegin;
+  std::function<void()> onAsyncEnd;
+
+  size_t maxJobsInFlight = 64; // submit fails when this many jobs are queued or running
+  BufferPool pool;             // input, output & readback buffers of jobs
+
+  using DoneCallback = std::function<void(bool ok, const void* output, size_t outputSize)>;
+
+  struct Job {
+    uint32_t kernel = 0;
+    const void* input = nullptr; // copied by submit
+    size_t inputSize = 0;        // nbytes; a multiple of 4
+    size_t outputSize = 0;       // nbytes; a multiple of 4
+    uint32_t invocations = 0;    // 0 means one per output element (outputSize / 4)
+    DoneCallback done;
+  };
+
+  explicit ComputeRunner(wgpu::Device device)
+      : pool(device), _device(device), _queue(device.GetQueue()) {}
+  ~ComputeRunner();
+
+  // registerKernel compiles a kernel. Returns its id, or 0 on error.
+  uint32_t registerKernel(const char* wgsl, const char* entryPoint, uint32_t workgroupSize);
+
+  // submit queues a job. Returns false if the job is invalid, maxJobsInFlight is reached or
+  // its buffers would exceed pool.maxBytes.
+  bool submit(const Job& job);
+
+  // flush dispatches all queued jobs. Returns the number of jobs dispatched.
+  size_t flush();
+
+  size_t queued() const {
+    return _queued.size();
+  }
+  size_t running() const {
+    return _running.size();
+  }
+
+private:
+  struct Kernel {
+    wgpu::ComputePipeline pipeline;
+    uint32_t workgroupSize;
+  };
+  struct Running; // job being run; userdata of MapAsync
+
+  static void onMapped(WGPUBufferMapAsyncStatus status, void* userdata);
+  void releaseBuffers(Running* r);
+
+  wgpu::Device _device;
+  wgpu::Queue _queue;
+  wgpu::BindGroupLayout _bindGroupLayout;
+  wgpu::PipelineLayout _pipelineLayout;
+  std::vector<Kernel> _kernels;          // kernel id N is at index N-1
+  std::deque<Running*> _queued;          // submitted, waiting for flush
+  std::unordered_set<Running*> _running; // flushed, waiting for output
+};
@@ -0,0 +1,64 @@
+#define DLOG_PREFIX "\e[1;33m[devicepool]\e[0m "
+
+#include "devicepool.hh"
+#include "common.hh"
+
+void DevicePool::start(size_t size) {
+  assert(!_thread.joinable());
+  _size = size;
+  _quit = false;
+  _thread = std::thread(&DevicePool::run, this);
+}
+
+std::deque<wgpu::Device> DevicePool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    _quit = true;
+  }
+  _cond.notify_one();
+  if (_thread.joinable()) {
+    _thread.join();
+  }
+  std::lock_guard<std::mutex> lock(_mu);
+  std::deque<wgpu::Device> devices;
+  devices.swap(_ready);
+  return devices;
+}
+
+wgpu::Device DevicePool::take() {
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    if (!_ready.empty()) {
+      wgpu::Device device = std::move(_ready.front());
+      _ready.pop_front();
+      _cond.notify_one(); // refill
+      return device;
+    }
+  }
+  dlog("device pool is empty; creating device");
+  return createDevice();
+}
+
+size_t DevicePool::ready() {
+  std::lock_guard<std::mutex> lock(_mu);
+  return _ready.size();
+}
+
+// run is the pool's background thread; it keeps _size devices in _ready
+void DevicePool::run() {
+  std::unique_lock<std::mutex> lock(_mu);
+  while (true) {
+    _cond.wait(lock, [this] { return _quit || _ready.size() < _size; });
+    if (_quit) {
+      break;
+    }
+    lock.unlock();
+    wgpu::Device device = createDevice();
+    lock.lock();
+    if (!device) {
+      errlog("device pool: failed to create device");
+      break;
+    }
+    _ready.push_back(std::move(device));
+  }
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <dawn/webgpu_cpp.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// DevicePool keeps a number of devices created ahead of time, so that taking one is
+// cheap. Devices are not returned to the pool after use; instead the pool creates
+// replacements on a background thread.
+struct DevicePool {
+  // createDevice is called on the pool's thread (or by take when the pool is empty)
+  std::function<wgpu::Device()> createDevice;
+
+  DevicePool() = default;
+  DevicePool(const DevicePool&) = delete;
+  ~DevicePool() {
+    stop();
+  }
+
+  // start starts creating devices in the background, keeping size of them ready
+  void start(size_t size);
+
+  // stop stops the background thread and returns the devices still in the pool.
+  // The caller decides when and how to release them.
+  std::deque<wgpu::Device> stop();
+
+  // take returns a ready device, or creates one right away if none is ready.
+  // Returns a null device if device creation failed.
+  wgpu::Device take();
+
+  // ready returns the number of devices ready to be taken
+  size_t ready();
+
+  // internal
+  void run();
+
+  size_t _size = 0;
+  std::thread _thread;
+  std::mutex _mu; // protects the fields below
+  std::condition_variable _cond;
+  std::deque<wgpu::Device> _ready;
+  bool _quit = false;
+};
@@ -0,0 +1,222 @@
+#include "diskcache.hh"
+
+#include <algorithm>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Entry files start with a header, followed by the key and the value
+#define DISKCACHE_MAGIC 0x31424344u /* "DCB1" */
+struct DiskCacheHeader {
+  uint32_t magic;
+  uint32_t keySize;
+};
+
+#define DISKCACHE_NAME_LEN 32 /* hex chars */
+
+// hashName returns 128 bits of hash of key in hex
+std::string DiskCache::hashName(const void* key, size_t keySize) {
+  const uint8_t* p = (const uint8_t*)key;
+  uint64_t h1 = 0xcbf29ce484222325ull; // FNV-1a
+  uint64_t h2 = 0x9e3779b97f4a7c15ull ^ keySize;
+  for (size_t i = 0; i < keySize; i++) {
+    h1 = (h1 ^ p[i]) * 0x100000001b3ull;
+    h2 = (h2 ^ p[i]) * 0xff51afd7ed558ccdull;
+    h2 ^= h2 >> 29;
+  }
+  char buf[DISKCACHE_NAME_LEN + 1];
+  snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)h1, (unsigned long long)h2);
+  return std::string(buf, DISKCACHE_NAME_LEN);
+}
+
+static bool isEntryName(const char* name) {
+  if (strlen(name) != DISKCACHE_NAME_LEN) {
+    return false;
+  }
+  for (const char* p = name; *p; p++) {
+    if (!isxdigit((unsigned char)*p)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool readFull(int fd, void* dst, size_t nbyte) {
+  char* p = (char*)dst;
+  while (nbyte > 0) {
+    ssize_t n = read(fd, p, nbyte);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    nbyte -= (size_t)n;
+  }
+  return true;
+}
+
+static bool writeFull(int fd, const void* src, size_t nbyte) {
+  const char* p = (const char*)src;
+  while (nbyte > 0) {
+    ssize_t n = write(fd, p, nbyte);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    nbyte -= (size_t)n;
+  }
+  return true;
+}
+
+bool DiskCache::open(const char* dir) {
+  std::lock_guard<std::mutex> lock(_mu);
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    return false;
+  }
+  DIR* d = opendir(dir);
+  if (d == nullptr) {
+    return false;
+  }
+  _dir = dir;
+  _entries.clear();
+  _totalSize = 0;
+
+  // index existing entries, oldest first
+  std::vector<std::pair<time_t, std::string>> found;
+  while (struct dirent* ent = readdir(d)) {
+    if (!isEntryName(ent->d_name)) {
+      continue;
+    }
+    struct stat st;
+    if (stat(entryPath(ent->d_name).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    found.emplace_back(st.st_mtime, ent->d_name);
+    _entries[ent->d_name] = Entry{(size_t)st.st_size, 0};
+    _totalSize += (size_t)st.st_size;
+  }
+  closedir(d);
+  std::sort(found.begin(), found.end());
+  for (auto& it : found) {
+    _entries[it.second].lastUsed = ++_clock;
+  }
+  evict();
+  return true;
+}
+
+std::string DiskCache::entryPath(const std::string& name) const {
+  return _dir + "/" + name;
+}
+
+// readEntry reads the value of entry name into *value, verifying that it is for key
+bool DiskCache::readEntry(const std::string& name, const void* key, size_t keySize,
+                          std::vector<char>* value) {
+  int fd = ::open(entryPath(name).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = false;
+  struct stat st;
+  DiskCacheHeader h;
+  if (fstat(fd, &st) == 0 && readFull(fd, &h, sizeof(h)) && h.magic == DISKCACHE_MAGIC &&
+      h.keySize == keySize && (size_t)st.st_size >= sizeof(h) + keySize) {
+    std::vector<char> storedKey(keySize);
+    if (readFull(fd, storedKey.data(), keySize) && memcmp(storedKey.data(), key, keySize) == 0) {
+      value->resize((size_t)st.st_size - sizeof(h) - keySize);
+      ok = readFull(fd, value->data(), value->size());
+    }
+  }
+  close(fd);
+  return ok;
+}
+
+size_t DiskCache::LoadData(const void* key, size_t keySize, void* value, size_t valueSize) {
+  std::string name = hashName(key, keySize);
+  std::lock_guard<std::mutex> lock(_mu);
+  auto it = _entries.find(name);
+  if (it == _entries.end()) {
+    return 0;
+  }
+  if (_lastName != name) {
+    if (!readEntry(name, key, keySize, &_lastValue)) {
+      _lastName.clear();
+      return 0; // hash collision or unreadable file
+    }
+    _lastName = name;
+  }
+  it->second.lastUsed = ++_clock;
+  if (value != nullptr && valueSize == _lastValue.size()) {
+    memcpy(value, _lastValue.data(), valueSize);
+  }
+  return _lastValue.size();
+}
+
+void DiskCache::StoreData(const void* key, size_t keySize, const void* value, size_t valueSize) {
+  std::string name = hashName(key, keySize);
+  std::lock_guard<std::mutex> lock(_mu);
+  if (_dir.empty() || _entries.count(name) != 0) {
+    return;
+  }
+  size_t size = sizeof(DiskCacheHeader) + keySize + valueSize;
+  if (size > maxSize) {
+    return;
+  }
+
+  // write to a temporary file, then rename it into place so readers never see partial data
+  char tmpsuffix[32];
+  snprintf(tmpsuffix, sizeof(tmpsuffix), ".tmp%d", (int)getpid());
+  std::string path = entryPath(name);
+  std::string tmppath = path + tmpsuffix;
+  int fd = ::open(tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return;
+  }
+  DiskCacheHeader h = {DISKCACHE_MAGIC, (uint32_t)keySize};
+  bool ok = writeFull(fd, &h, sizeof(h)) && writeFull(fd, key, keySize) &&
+            writeFull(fd, value, valueSize);
+  ok = (close(fd) == 0) && ok;
+  if (!ok || rename(tmppath.c_str(), path.c_str()) != 0) {
+    unlink(tmppath.c_str());
+    return;
+  }
+  _entries[name] = Entry{size, ++_clock};
+  _totalSize += size;
+  evict();
+}
+
+void DiskCache::evict() {
+  while (_totalSize > maxSize && !_entries.empty()) {
+    auto oldest = _entries.begin();
+    for (auto it = _entries.begin(); it != _entries.end(); ++it) {
+      if (it->second.lastUsed < oldest->second.lastUsed) {
+        oldest = it;
+      }
+    }
+    unlink(entryPath(oldest->first).c_str());
+    _totalSize -= oldest->second.size;
+    if (_lastName == oldest->first) {
+      _lastName.clear();
+    }
+    _entries.erase(oldest);
+  }
+}
+
+size_t DiskCache::entryCount() {
+  std::lock_guard<std::mutex> lock(_mu);
+  return _entries.size();
+}
+
+size_t DiskCache::totalSize() {
+  std::lock_guard<std::mutex> lock(_mu);
+  return _totalSize;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <dawn/platform/DawnPlatform.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// DiskCache is a size-bounded, content-addressed blob cache in a directory, used by Dawn
+// to cache compiled shaders and pipelines across devices and server restarts.
+//
+// Each entry is a file named after a hash of its key, holding the key and the value.
+// When the total size exceeds maxSize, least recently used entries are removed.
+// Safe to use from multiple threads.
+class DiskCache : public dawn::platform::CachingInterface {
+public:
+  size_t maxSize = 256 * 1024 * 1024; // bytes
+
+  // open prepares dir for use, creating it if needed, and indexes existing entries.
+  // Returns false on error with errno set.
+  bool open(const char* dir);
+
+  // dawn::platform::CachingInterface
+  // LoadData returns the size of the value for key, or 0 if not found. When value is not
+  // null and valueSize matches, the value is also copied to value.
+  size_t LoadData(const void* key, size_t keySize, void* value, size_t valueSize) override;
+  void StoreData(const void* key, size_t keySize, const void* value, size_t valueSize) override;
+
+  // hashName returns the 32 hex character name used for an entry with the given key
+  static std::string hashName(const void* key, size_t keySize);
+
+  // statistics
+  size_t entryCount();
+  size_t totalSize();
+
+private:
+  struct Entry {
+    size_t size;       // file size
+    uint64_t lastUsed; // _clock value
+  };
+
+  std::string entryPath(const std::string& name) const;
+  bool readEntry(const std::string& name, const void* key, size_t keySize,
+                 std::vector<char>* value);
+  void evict(); // must hold _mu
+
+  std::mutex _mu; // protects everything below
+  std::string _dir;
+  std::unordered_map<std::string, Entry> _entries; // keyed by file name
+  size_t _totalSize = 0;
+  uint64_t _clock = 0;
+
+  // Dawn calls LoadData twice for a hit (size, then data); the second call is served from
+  // the value read by the first.
+  std::string _lastName;
+  std::vector<char> _lastValue;
+};
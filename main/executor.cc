@@ -0,0 +1,227 @@
+#include "executor.hh"
+#include "common.hh"
+
+#define CMDFRAME_MIN_CAP (64 * 1024) /* initial capacity of reply frames */
+
+CmdFrame* CmdFrame::alloc(size_t cap) {
+  CmdFrame* f = (CmdFrame*)malloc(sizeof(CmdFrame) + cap);
+  if (f != nullptr) {
+    f->cap = (uint32_t)cap;
+    f->len = 0;
+  }
+  return f;
+}
+
+static void CommandExecutor_onReplyAsync(RunLoop* rl, ev_async* w, int revents) {
+  CommandExecutor* e = (CommandExecutor*)w->data;
+  e->deliverReplies();
+  e->submitPending();
+}
+
+CommandExecutor::~CommandExecutor() {
+  stop();
+  join();
+  CmdFrame* f;
+  while (_execq.pop(&f)) {
+    free(f);
+  }
+  for (CmdFrame* f : _pending) {
+    free(f);
+  }
+  for (CmdFrame* f : _replies) {
+    free(f);
+  }
+  free(_out);
+}
+
+bool CommandExecutor::start(RunLoop* rl, dawn::wire::CommandSerializer* replyTo,
+                            bool execThread) {
+  assert(_rl == nullptr && !_thread.joinable());
+  _rl = rl;
+  _loop = rl;
+  _replyTo = replyTo;
+  _replyAsync.data = this;
+  ev_async_init(&_replyAsync, CommandExecutor_onReplyAsync);
+  ev_async_start(rl, &_replyAsync);
+  if (execThread) {
+    _thread = std::thread(&CommandExecutor::run, this);
+  }
+  return true;
+}
+
+void CommandExecutor::stop() {
+  if (_rl == nullptr) {
+    return;
+  }
+  _quit.store(true);
+  _execSeq.fetch_add(1);
+  _execSeq.notify_one();
+  ev_async_stop(_rl, &_replyAsync);
+  _rl = nullptr;
+  _replyTo = nullptr;
+}
+
+void CommandExecutor::join() {
+  if (_thread.joinable()) {
+    _thread.join();
+  }
+}
+
+// A CmdFrame of length 0 on _execq or in _replies is a marker (see submitMarker)
+bool CommandExecutor::submit(const char* data, size_t len) {
+  if (_rl == nullptr || _quit.load() || !_thread.joinable()) {
+    return false;
+  }
+  CmdFrame* f = CmdFrame::alloc(len);
+  if (f == nullptr) {
+    return false;
+  }
+  if (len > 0) {
+    memcpy(f->data(), data, len);
+  }
+  f->len = (uint32_t)len;
+  if (!_pending.empty() || !_execq.push(f)) {
+    // Queue is full; the exec thread is behind. Hold f back and have the caller stop
+    // producing until the exec thread has made room (see submitPending.)
+    _pending.push_back(f);
+    if (!_full.load(std::memory_order_relaxed)) {
+      _full.store(true);
+      std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the one in run
+      ev_async_send(_rl, &_replyAsync); // in case the exec thread made room before seeing _full
+      if (onQueueFull) {
+        onQueueFull(true);
+      }
+    }
+    return true;
+  }
+  _execSeq.fetch_add(1, std::memory_order_release);
+  _execSeq.notify_one();
+  return true;
+}
+
+// submitPending moves command buffers held back by submit onto the execution queue and,
+// once the exec thread has drained half of it, lets the caller resume. I/O thread only.
+void CommandExecutor::submitPending() {
+  if (!_full.load(std::memory_order_relaxed) || _rl == nullptr) {
+    return;
+  }
+  bool pushed = false;
+  while (!_pending.empty() && _execq.push(_pending.front())) {
+    _pending.pop_front();
+    pushed = true;
+  }
+  if (pushed) {
+    _execSeq.fetch_add(1, std::memory_order_release);
+    _execSeq.notify_one();
+  }
+  if (_pending.empty() && _execq.len() <= _execq.capacity() / 2) {
+    _full.store(false);
+    if (onQueueFull) {
+      onQueueFull(false);
+    }
+  }
+}
+
+bool CommandExecutor::submitMarker() {
+  return submit(nullptr, 0);
+}
+
+// run is the exec thread's main function
+void CommandExecutor::run() {
+  while (true) {
+    uint32_t seq = _execSeq.load(std::memory_order_acquire);
+    if (_quit.load()) {
+      break;
+    }
+    CmdFrame* f;
+    if (!_execq.pop(&f)) {
+      _execSeq.wait(seq); // until submit or stop
+      continue;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the one in submit
+    if (_full.load(std::memory_order_relaxed)) {
+      ev_async_send(_loop, &_replyAsync); // there's room for held back command buffers
+    }
+    if (f->len == 0) {
+      execute(nullptr, 0); // flushes replies of earlier commands
+      pushReply(f);
+      continue;
+    }
+    execute(f->data(), f->len);
+    free(f);
+  }
+}
+
+// deliverReplies writes replies from the exec thread to _replyTo. I/O thread only.
+void CommandExecutor::deliverReplies() {
+  std::vector<CmdFrame*> replies;
+  {
+    std::lock_guard<std::mutex> lock(_replyMu);
+    replies.swap(_replies);
+  }
+  // Writing to _replyTo may fail and close the connection, which stops the executor and
+  // clears _replyTo; the rest of the replies are then dropped.
+  bool delivered = false;
+  for (CmdFrame* f : replies) {
+    if (f->len == 0) {
+      if (delivered && _replyTo != nullptr) {
+        _replyTo->Flush();
+      }
+      delivered = false;
+      if (_replyTo != nullptr && onMarker) {
+        onMarker();
+      }
+    } else if (_replyTo != nullptr) {
+      void* p = _replyTo->GetCmdSpace(f->len);
+      if (p != nullptr) {
+        memcpy(p, f->data(), f->len);
+        delivered = true;
+      } else {
+        errlog("failed to allocate %u bytes for reply", f->len);
+      }
+    }
+    free(f);
+  }
+  if (delivered && _replyTo != nullptr) {
+    _replyTo->Flush();
+  }
+}
+
+// pushReply passes f to the I/O thread
+void CommandExecutor::pushReply(CmdFrame* f) {
+  {
+    std::lock_guard<std::mutex> lock(_replyMu);
+    _replies.push_back(f);
+  }
+  ev_async_send(_loop, &_replyAsync);
+}
+
+size_t CommandExecutor::GetMaximumAllocationSize() const {
+  return maxAllocationSize;
+}
+
+void* CommandExecutor::GetCmdSpace(size_t size) {
+  if (size > maxAllocationSize) {
+    return nullptr;
+  }
+  if (_out != nullptr && _out->cap - _out->len < size) {
+    pushReply(_out);
+    _out = nullptr;
+  }
+  if (_out == nullptr && (_out = CmdFrame::alloc(std::max(size, (size_t)CMDFRAME_MIN_CAP))) ==
+                           nullptr) {
+    return nullptr;
+  }
+  char* p = _out->data() + _out->len;
+  _out->len += (uint32_t)size;
+  return p;
+}
+
+bool CommandExecutor::Flush() {
+  if (_out == nullptr || _out->len == 0) {
+    return true;
+  }
+  pushReply(_out);
+  _out = nullptr;
+  return true;
+}
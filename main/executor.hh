@@ -0,0 +1,100 @@
+#pragma once
+#include "protocol.hh"
+#include "spsc.hh"
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// CmdFrame is a buffer of Dawn command data handed between threads
+struct CmdFrame {
+  uint32_t cap; // capacity of data()
+  uint32_t len; // nbytes used of data()
+  char* data() {
+    return (char*)(this + 1);
+  }
+  static CmdFrame* alloc(size_t cap);
+};
+
+// CommandExecutor runs Dawn command buffers on a separate execution thread, so that the
+// I/O thread can read the next batch from the socket while the current one executes.
+//
+// The I/O thread passes complete command buffers to submit, which puts them on a
+// lock-free SPSC queue. The exec thread calls execute for each of them, in order.
+// Replies serialized on the exec thread (the executor is the CommandSerializer for the
+// execute callback) are handed back to the I/O thread and written to replyTo there, so
+// that replyTo is only ever used by its own thread.
+// Dawn may also serialize replies outside of execute (e.g. callbacks fired while another
+// connection's commands execute), so the CommandSerializer methods may be called from any
+// thread, as long as calls are serialized by the caller.
+//
+// Started without an exec thread, the executor only does the latter: the caller runs
+// commands itself, on the I/O thread, and replies still reach replyTo on that thread
+// only. The caller may call deliverReplies to write them right away.
+struct CommandExecutor : public dawn::wire::CommandSerializer {
+  // execute is called on the exec thread for each command buffer. It must flush the
+  // executor when done. It is called with len 0 for markers, to flush only.
+  std::function<void(const char* data, size_t len)> execute;
+  size_t maxAllocationSize = DAWNCMD_STREAM_MAX; // for GetMaximumAllocationSize
+
+  // onMarker is called on the I/O thread for each submitMarker call, once the command
+  // buffers submitted before it have executed and their replies have been delivered
+  std::function<void()> onMarker;
+
+  // onQueueFull is called on the I/O thread with true when the execution queue has filled
+  // up and with false once the exec thread has caught up. The I/O thread should stop
+  // reading input in between; command buffers submitted meanwhile are held back.
+  std::function<void(bool full)> onQueueFull;
+
+  CommandExecutor() = default;
+  CommandExecutor(const CommandExecutor&) = delete;
+  ~CommandExecutor();
+
+  // start starts the executor, and the exec thread if execThread is true.
+  // Replies are written to replyTo on rl's thread.
+  bool start(RunLoop* rl, dawn::wire::CommandSerializer* replyTo, bool execThread = true);
+
+  // stop asks the exec thread to exit after the command buffer currently executing and
+  // stops delivering replies. join waits for the thread to exit; the executor can not
+  // be restarted. join must not be called with any lock held which execute may need.
+  void stop();
+  void join();
+
+  // submit copies a command buffer onto the execution queue. I/O thread only.
+  // Never blocks; see onQueueFull. Returns false if the exec thread is not running.
+  bool submit(const char* data, size_t len);
+
+  // submitMarker puts a marker on the execution queue (see onMarker.) I/O thread only.
+  bool submitMarker();
+
+  // dawn_wire::CommandSerializer (see above)
+  size_t GetMaximumAllocationSize() const override;
+  void* GetCmdSpace(size_t size) override;
+  bool Flush() override;
+
+  // internal
+  void run();
+  void deliverReplies();
+  void submitPending();
+  void pushReply(CmdFrame*);
+
+  RunLoop* _rl = nullptr;   // nullptr when stopped
+  RunLoop* _loop = nullptr; // like _rl, but not cleared by stop; for ev_async_send
+  dawn::wire::CommandSerializer* _replyTo = nullptr;
+  ev_async _replyAsync; // signals _rl's thread that replies are waiting in _replies
+  std::thread _thread;
+  std::atomic<bool> _quit{false};
+
+  SPSCQueue<CmdFrame*, 256> _execq; // I/O thread -> exec thread
+  std::atomic<uint32_t> _execSeq{0}; // bumped when _execq gets data or on stop
+  std::deque<CmdFrame*> _pending;    // submitted while _execq was full (I/O thread only)
+  std::atomic<bool> _full{false};    // _pending is in use; exec thread signals _replyAsync
+
+  // Replies (exec thread -> I/O thread.) Unlike _execq this never blocks the producer,
+  // which may be holding locks that the I/O thread needs.
+  std::mutex _replyMu;
+  std::vector<CmdFrame*> _replies;
+
+  CmdFrame* _out = nullptr; // reply being serialized on the exec thread
+};
@@ -0,0 +1,262 @@
+#include "log.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <strings.h> // strcasecmp
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_THREAD_BUFSIZE (64 * 1024) /* per-thread buffer size; power of two */
+#define LOG_LINE_MAX 2048               /* longer lines are truncated */
+
+static int initialLogLevel() {
+  const char* s = getenv("DAWN_LOG_LEVEL");
+  if (s == nullptr || *s == 0) {
+    return LOG_LEVEL_DEBUG; // whatever LOG_LEVEL_MAX lets through
+  }
+  static const char* names[] = {"error", "warn", "info", "debug"};
+  for (int i = 0; i < 4; i++) {
+    if (strcasecmp(s, names[i]) == 0) {
+      return i;
+    }
+  }
+  return atoi(s);
+}
+
+std::atomic<int> logLevel{initialLogLevel()};
+
+// LogBuffer is a single-producer, single-consumer ring of length-prefixed lines.
+// The producer is the thread that owns it, the consumer the writer thread.
+struct LogBuffer {
+  std::atomic<size_t> r{0};
+  std::atomic<size_t> w{0};
+  std::atomic<bool> closed{false}; // owner thread has exited; freed by the writer once empty
+  std::atomic<uint64_t> dropped{0};
+  char data[LOG_THREAD_BUFSIZE];
+
+  bool push(const char* line, uint16_t len) {
+    size_t wpos = w.load(std::memory_order_relaxed);
+    if (LOG_THREAD_BUFSIZE - (wpos - r.load(std::memory_order_acquire)) < len + 2u) {
+      return false;
+    }
+    copyIn(wpos, (const char*)&len, 2);
+    copyIn(wpos + 2, line, len);
+    w.store(wpos + 2 + len, std::memory_order_release);
+    return true;
+  }
+
+  size_t len() const {
+    return w.load(std::memory_order_relaxed) - r.load(std::memory_order_relaxed);
+  }
+
+  // drain appends all complete lines to out. Returns true if there were any.
+  bool drain(std::string& out) {
+    size_t rpos = r.load(std::memory_order_relaxed);
+    size_t wpos = w.load(std::memory_order_acquire);
+    if (rpos == wpos) {
+      return false;
+    }
+    while (rpos < wpos) {
+      uint16_t len;
+      copyOut(rpos, (char*)&len, 2);
+      size_t offs = out.size();
+      out.resize(offs + len);
+      copyOut(rpos + 2, &out[offs], len);
+      rpos += 2 + len;
+    }
+    r.store(rpos, std::memory_order_release);
+    return true;
+  }
+
+  void copyIn(size_t pos, const char* src, size_t n) {
+    size_t i = pos & (LOG_THREAD_BUFSIZE - 1);
+    size_t k = std::min(n, (size_t)LOG_THREAD_BUFSIZE - i);
+    memcpy(&data[i], src, k);
+    memcpy(&data[0], src + k, n - k);
+  }
+  void copyOut(size_t pos, char* dst, size_t n) const {
+    size_t i = pos & (LOG_THREAD_BUFSIZE - 1);
+    size_t k = std::min(n, (size_t)LOG_THREAD_BUFSIZE - i);
+    memcpy(dst, &data[i], k);
+    memcpy(dst + k, &data[0], n - k);
+  }
+};
+
+static std::mutex _mu; // protects everything below
+static std::condition_variable _wake;
+static std::vector<LogBuffer*> _buffers;
+static std::thread _writer;
+static bool _quit = false;
+static std::atomic<bool> _running{false}; // writer thread is running
+
+static void writeAll(const char* p, size_t n) {
+  while (n > 0) {
+    ssize_t k = write(STDERR_FILENO, p, n);
+    if (k < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    p += k;
+    n -= (size_t)k;
+  }
+}
+
+// drainBuffers writes the lines of all buffers to stderr and frees closed, empty ones.
+// Call with _mu locked.
+static void drainBuffers(std::string& out) {
+  out.clear();
+  for (size_t i = 0; i < _buffers.size();) {
+    LogBuffer* b = _buffers[i];
+    bool closed = b->closed.load(std::memory_order_acquire);
+    b->drain(out);
+    if (uint64_t n = b->dropped.exchange(0, std::memory_order_relaxed)) {
+      out += "[" + std::to_string(n) + " log lines dropped]\n";
+    }
+    if (closed) {
+      _buffers[i] = _buffers.back();
+      _buffers.pop_back();
+      delete b;
+    } else {
+      i++;
+    }
+  }
+  writeAll(out.data(), out.size());
+}
+
+static void writerMain() {
+  std::string out;
+  std::unique_lock<std::mutex> lock(_mu);
+  while (!_quit) {
+    drainBuffers(out);
+    _wake.wait_for(lock, std::chrono::duration<double>(LOG_FLUSH_INTERVAL));
+  }
+  drainBuffers(out);
+}
+
+static void stopWriter() {
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    _quit = true;
+    _running.store(false);
+  }
+  _wake.notify_one();
+  _writer.join();
+}
+
+// threadBuffer returns the calling thread's buffer, or null if logging is synchronous
+// (before the writer has started or after it has stopped at exit)
+static thread_local LogBuffer* _tbuf = nullptr;
+static thread_local bool _tbufGuarded = false;
+struct LogBufferGuard {
+  ~LogBufferGuard() {
+    if (_tbuf != nullptr) {
+      _tbuf->closed.store(true, std::memory_order_release);
+      _tbuf = nullptr;
+    }
+  }
+};
+static thread_local LogBufferGuard _tbufGuard;
+
+static LogBuffer* threadBuffer() {
+  static std::once_flag started;
+  std::call_once(started, []() {
+    _writer = std::thread(writerMain);
+    _running.store(true);
+    atexit(stopWriter);
+  });
+  if (!_running.load(std::memory_order_acquire)) {
+    return nullptr;
+  }
+  if (_tbuf != nullptr) {
+    return _tbuf;
+  }
+  std::lock_guard<std::mutex> lock(_mu);
+  if (_quit) {
+    return nullptr;
+  }
+  _tbuf = new LogBuffer();
+  _buffers.push_back(_tbuf);
+  if (!_tbufGuarded) {
+    _tbufGuarded = true;
+    (void)&_tbufGuard; // closes the buffer when the thread exits
+  }
+  return _tbuf;
+}
+
+// formatTimestamp writes "HH:MM:SS.uuuuuu " to dst (17 bytes incl. terminator)
+static size_t formatTimestamp(char* dst) {
+  static thread_local time_t cachedSec = -1;
+  static thread_local char cachedHMS[9];
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  if (ts.tv_sec != cachedSec) {
+    struct tm tm;
+    localtime_r(&ts.tv_sec, &tm);
+    strftime(cachedHMS, sizeof(cachedHMS), "%H:%M:%S", &tm);
+    cachedSec = ts.tv_sec;
+  }
+  memcpy(dst, cachedHMS, 8);
+  uint32_t us = (uint32_t)(ts.tv_nsec / 1000);
+  dst[8] = '.';
+  for (int i = 14; i > 8; i--) {
+    dst[i] = (char)('0' + us % 10);
+    us /= 10;
+  }
+  dst[15] = ' ';
+  dst[16] = 0;
+  return 16;
+}
+
+void logWrite(int level, const char* format, ...) {
+  char line[LOG_LINE_MAX];
+  size_t n = formatTimestamp(line);
+  va_list ap;
+  va_start(ap, format);
+  int k = vsnprintf(line + n, sizeof(line) - n - 1, format, ap);
+  va_end(ap);
+  if (k < 0) {
+    return;
+  }
+  n = std::min(n + (size_t)k, sizeof(line) - 2); // truncated if too long
+  line[n++] = '\n';
+
+  if (level < LOG_LEVEL_DEBUG) {
+    // write synchronously, after whatever was logged before
+    std::string out;
+    std::lock_guard<std::mutex> lock(_mu);
+    drainBuffers(out);
+    writeAll(line, n);
+    return;
+  }
+  LogBuffer* b = threadBuffer();
+  if (b != nullptr && b->push(line, (uint16_t)n)) {
+    if (b->len() > LOG_THREAD_BUFSIZE / 2) {
+      _wake.notify_one(); // don't wait for LOG_FLUSH_INTERVAL
+    }
+    return;
+  }
+  if (b != nullptr) {
+    b->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  writeAll(line, n);
+}
+
+void logFlush() {
+  std::string out;
+  std::lock_guard<std::mutex> lock(_mu);
+  drainBuffers(out);
+}
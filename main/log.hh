@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+
+// Logging. Each thread formats its debug lines into a buffer of its own, which a
+// background thread drains to stderr about every LOG_FLUSH_INTERVAL seconds, so debug
+// logging never blocks on stderr and threads never contend with each other. A debug line
+// that doesn't fit in its thread's buffer is dropped (and counted). Other lines (errors)
+// are written directly, right after any buffered lines, so that the last line before a
+// crash is never lost. Timestamps are formatted once per second per thread.
+//
+// Levels are filtered at compile time by LOG_LEVEL_MAX (lines above it are compiled out)
+// and at runtime by logLevel, initially from the DAWN_LOG_LEVEL environment variable
+// ("error", "warn", "info", "debug" or 0-3).
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef LOG_LEVEL_MAX
+#ifdef DEBUG
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#else
+#define LOG_LEVEL_MAX LOG_LEVEL_ERROR
+#endif
+#endif
+
+#define LOG_FLUSH_INTERVAL 0.01 /* seconds */
+
+extern std::atomic<int> logLevel;
+
+inline bool logEnabled(int level) {
+  return level <= logLevel.load(std::memory_order_relaxed);
+}
+
+void logWrite(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+// logFlush writes all buffered lines to stderr before returning
+void logFlush();
+
+#define LOG(level, format, ...)                                                                    \
+  do {                                                                                             \
+    if ((level) <= LOG_LEVEL_MAX && logEnabled(level)) {                                           \
+      logWrite((level), format, ##__VA_ARGS__);                                                    \
+    }                                                                                              \
+  } while (0)
+
+// dlog logs a debug message; DLOG_PREFIX must be defined
+#define dlog(format, ...)                                                                          \
+  LOG(LOG_LEVEL_DEBUG, DLOG_PREFIX format " \e[2m(%s %d)\e[0m", ##__VA_ARGS__, __FUNCTION__,     \
+      __LINE__)
+
+#ifdef DEBUG
+#define errlog(format, ...)                                                                        \
+  LOG(LOG_LEVEL_ERROR, "E " format " (%s:%d)", ##__VA_ARGS__, __FILE__, __LINE__)
+#else
+#define errlog(format, ...) LOG(LOG_LEVEL_ERROR, "E " format, ##__VA_ARGS__)
+#endif
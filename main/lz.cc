@@ -0,0 +1,197 @@
+#include "lz.hh"
+
+#include <stdint.h>
+#include <string.h>
+
+// LZ4 block format: a series of sequences, each made up of
+//   token       1 byte; high 4 bits: literal length, low 4 bits: match length - 4
+//   [litlen]    more literal length bytes (when 15), each adding 0-255; 255 means "more"
+//   literals    litlen bytes copied verbatim
+//   offset      2 bytes little endian; distance back to the match (1-65535)
+//   [matchlen]  more match length bytes (when 15)
+// The last sequence only has literals. Its last 5 bytes are always literals and the last
+// match starts at least 12 bytes before the end.
+
+#define LZ_HASH_LOG 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5
+#define LZ_MFLIMIT 12
+
+static inline uint32_t lzRead32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint32_t lzHash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static inline uint8_t* lzWriteLen(uint8_t* op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+// lzWriteSequence writes litlen literals and a match (unless last); nullptr if out of space
+static uint8_t* lzWriteSequence(uint8_t* op, const uint8_t* oend, const uint8_t* lit,
+                                size_t litlen, size_t offset, size_t matchlen, bool last) {
+  size_t need = 1 + litlen + litlen / 255 + 1;
+  if (!last) {
+    need += 2 + matchlen / 255 + 1;
+  }
+  if (need > (size_t)(oend - op)) {
+    return nullptr;
+  }
+  uint8_t* token = op++;
+  *token = (uint8_t)((litlen < 15 ? litlen : 15) << 4);
+  if (litlen >= 15) {
+    op = lzWriteLen(op, litlen - 15);
+  }
+  if (litlen > 0) {
+    memcpy(op, lit, litlen);
+    op += litlen;
+  }
+  if (last) {
+    return op;
+  }
+  *op++ = (uint8_t)offset;
+  *op++ = (uint8_t)(offset >> 8);
+  *token |= (uint8_t)(matchlen < 15 ? matchlen : 15);
+  if (matchlen >= 15) {
+    op = lzWriteLen(op, matchlen - 15);
+  }
+  return op;
+}
+
+size_t lzCompress(const char* src_, size_t srclen, char* dst_, size_t dstcap) {
+  const uint8_t* src = (const uint8_t*)src_;
+  const uint8_t* end = src + srclen;
+  const uint8_t* anchor = src; // start of pending literals
+  uint8_t* op = (uint8_t*)dst_;
+  const uint8_t* oend = op + dstcap;
+
+  if (srclen > LZ_MFLIMIT) {
+    uint32_t table[1 << LZ_HASH_LOG]; // hash of 4 bytes => offset in src
+    memset(table, 0, sizeof(table));
+    const uint8_t* mflimit = end - LZ_MFLIMIT;
+    const uint8_t* matchlimit = end - LZ_LAST_LITERALS;
+    const uint8_t* ip = src + 1;
+    uint32_t misses = 0;
+
+    while (ip < mflimit) {
+      uint32_t h = lzHash(lzRead32(ip));
+      const uint8_t* ref = src + table[h];
+      table[h] = (uint32_t)(ip - src);
+      if (ip - ref > LZ_MAX_OFFSET || lzRead32(ref) != lzRead32(ip)) {
+        // step further ahead the longer we go without a match (incompressible data)
+        ip += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+
+      // extend the match backwards into pending literals, then forwards
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const uint8_t* mend = ip + LZ_MIN_MATCH;
+      ref += LZ_MIN_MATCH;
+      while (mend < matchlimit && *mend == *ref) {
+        mend++;
+        ref++;
+      }
+
+      op = lzWriteSequence(op, oend, anchor, (size_t)(ip - anchor), (size_t)(mend - ref),
+                           (size_t)(mend - ip) - LZ_MIN_MATCH, false);
+      if (op == nullptr) {
+        return 0;
+      }
+      ip = anchor = mend;
+      if (ip < mflimit) {
+        table[lzHash(lzRead32(ip - 2))] = (uint32_t)(ip - 2 - src);
+      }
+    }
+  }
+
+  op = lzWriteSequence(op, oend, anchor, (size_t)(end - anchor), 0, 0, true);
+  if (op == nullptr) {
+    return 0;
+  }
+  return (size_t)(op - (uint8_t*)dst_);
+}
+
+// lzReadLen adds extended length bytes at *ipp to *len. Returns false on truncated input.
+static inline bool lzReadLen(const uint8_t** ipp, const uint8_t* iend, size_t* len) {
+  const uint8_t* ip = *ipp;
+  uint8_t b;
+  do {
+    if (ip == iend) {
+      return false;
+    }
+    b = *ip++;
+    *len += b;
+  } while (b == 255);
+  *ipp = ip;
+  return true;
+}
+
+ssize_t lzDecompress(const char* src, size_t srclen, char* dst_, size_t dstcap) {
+  const uint8_t* ip = (const uint8_t*)src;
+  const uint8_t* iend = ip + srclen;
+  uint8_t* dst = (uint8_t*)dst_;
+  uint8_t* op = dst;
+  uint8_t* oend = dst + dstcap;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+
+    size_t litlen = token >> 4;
+    if (litlen == 15 && !lzReadLen(&ip, iend, &litlen)) {
+      return -1;
+    }
+    if (litlen > (size_t)(iend - ip) || litlen > (size_t)(oend - op)) {
+      return -1;
+    }
+    if (litlen > 0) {
+      memcpy(op, ip, litlen);
+      op += litlen;
+      ip += litlen;
+    }
+    if (ip == iend) {
+      break; // last sequence
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst)) {
+      return -1;
+    }
+    size_t matchlen = token & 15;
+    if (matchlen == 15 && !lzReadLen(&ip, iend, &matchlen)) {
+      return -1;
+    }
+    matchlen += LZ_MIN_MATCH;
+    if (matchlen > (size_t)(oend - op)) {
+      return -1;
+    }
+    const uint8_t* m = op - offset;
+    if (offset >= matchlen) {
+      memcpy(op, m, matchlen);
+      op += matchlen;
+    } else {
+      // overlapping match (run of a repeated pattern)
+      for (size_t i = 0; i < matchlen; i++) {
+        *op++ = m[i];
+      }
+    }
+  }
+  return (ssize_t)(op - dst);
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <stddef.h>
+#include <unistd.h>
+
+// Fast LZ77-class compression, producing the LZ4 block format.
+// Meant for Dawn wire command data, which is very repetitive (object ids, descriptors.)
+
+// lzCompress compresses srclen bytes of src into dst.
+// Returns the compressed size, or 0 if the result would not fit in dstcap bytes.
+size_t lzCompress(const char* src, size_t srclen, char* dst, size_t dstcap);
+
+// lzDecompress decompresses srclen bytes of src into dst.
+// Returns the decompressed size, or -1 if src is corrupt or does not fit in dstcap bytes.
+ssize_t lzDecompress(const char* src, size_t srclen, char* dst, size_t dstcap);
@@ -0,0 +1,125 @@
+#include "lz.hh"
+#include "testutil.hh"
+
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+enum InputKind { RANDOM, ZEROS, PATTERN, RECORDS, NUM_KINDS };
+static const char* kindNames[] = {"random", "zeros", "pattern", "records"};
+
+static std::vector<char> makeInput(InputKind kind, size_t size) {
+  std::vector<char> v(size);
+  for (size_t i = 0; i < size; i++) {
+    switch (kind) {
+    case RANDOM:
+      v[i] = (char)testRand();
+      break;
+    case ZEROS:
+      v[i] = 0;
+      break;
+    case PATTERN:
+      v[i] = "abcdefg"[i % 7];
+      break;
+    case RECORDS: // like Dawn commands: fixed-size structs with a few changing fields
+      if (i % 48 < 4) {
+        v[i] = (char)(i / 48);
+      } else if (i % 48 < 8) {
+        v[i] = (char)(testRand() & 3);
+      } else {
+        v[i] = (char)(i % 48);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  return v;
+}
+
+static void testRoundTrip(InputKind kind, size_t size) {
+  std::vector<char> src = makeInput(kind, size);
+  size_t zcap = size + size / 255 + 16; // worst case for incompressible input
+  std::vector<char> z(zcap);
+  size_t n = lzCompress(src.data(), size, z.data(), zcap);
+  if (n == 0) {
+    fprintf(stderr, "lzCompress failed (%s, %zu bytes)\n", kindNames[kind], size);
+    CHECK(n > 0);
+    return;
+  }
+  if (kind != RANDOM && size >= 1024) {
+    CHECK(n < size / 2);
+  }
+
+  // exactly sized output buffer, so that ASan catches any write past its end
+  std::vector<char> out(size);
+  ssize_t m = lzDecompress(z.data(), n, out.data(), size);
+  CHECK(m == (ssize_t)size);
+  CHECK(m != (ssize_t)size || size == 0 || memcmp(out.data(), src.data(), size) == 0);
+
+  if (size == 0) {
+    return;
+  }
+  // output that doesn't fit is rejected
+  std::vector<char> small(size - 1);
+  CHECK(lzDecompress(z.data(), n, small.data(), size - 1) == -1);
+
+  // Truncated input is rejected or decompresses to less than the expected size, which
+  // the protocol treats as corrupt
+  size_t step = std::max((size_t)1, n / 64);
+  for (size_t k = 0; k < n; k += step) {
+    CHECK(lzDecompress(z.data(), k, out.data(), size) != (ssize_t)size);
+  }
+
+  // Compressing into too small a buffer fails cleanly
+  if (n > 1) {
+    std::vector<char> zsmall(n - 1);
+    CHECK(lzCompress(src.data(), size, zsmall.data(), n - 1) == 0);
+  }
+
+  // Corrupt input must never write out of bounds
+  for (int i = 0; i < 32; i++) {
+    std::vector<char> bad(z.begin(), z.begin() + n);
+    bad[testRand() % n] ^= (char)(1 + testRand() % 255);
+    ssize_t r = lzDecompress(bad.data(), n, out.data(), size);
+    CHECK(r >= -1 && r <= (ssize_t)size);
+  }
+}
+
+static void testCorrupt() {
+  char out[64];
+  // token with 1 literal, then a match at offset 0
+  const char zeroOffset[] = {0x10, 'a', 0x00, 0x00};
+  CHECK(lzDecompress(zeroOffset, sizeof(zeroOffset), out, sizeof(out)) == -1);
+  // match reaching back before the start of the output
+  const char farOffset[] = {0x10, 'a', 0x02, 0x00};
+  CHECK(lzDecompress(farOffset, sizeof(farOffset), out, sizeof(out)) == -1);
+  // more literals than there is input
+  const char shortLiterals[] = {0x50, 'a', 'b'};
+  CHECK(lzDecompress(shortLiterals, sizeof(shortLiterals), out, sizeof(out)) == -1);
+  // extended literal length cut off
+  const char shortLength[] = {(char)0xf0, (char)0xff};
+  CHECK(lzDecompress(shortLength, sizeof(shortLength), out, sizeof(out)) == -1);
+  // offset cut off
+  const char shortOffset[] = {0x10, 'a', 0x01};
+  CHECK(lzDecompress(shortOffset, sizeof(shortOffset), out, sizeof(out)) == -1);
+  // match longer than the output buffer
+  const char longMatch[] = {0x1f, 'a', 0x01, 0x00, (char)0xff, 0x00, 0x00};
+  CHECK(lzDecompress(longMatch, sizeof(longMatch), out, sizeof(out)) == -1);
+  // an overlapping match is fine
+  const char run[] = {0x1f, 'a', 0x01, 0x00, 0x00, 0x00};
+  CHECK(lzDecompress(run, sizeof(run), out, sizeof(out)) == 20);
+}
+
+int main() {
+  size_t sizes[] = {0,     1,     2,     3,     4,     5,     11,    12,    13,     16,
+                    17,    31,    64,    255,   256,   4095,  4096,  4097,  65535,  65536,
+                    65537, 70000, 131072 + 3, 1 << 20};
+  for (size_t size : sizes) {
+    for (int kind = 0; kind < NUM_KINDS; kind++) {
+      testRoundTrip((InputKind)kind, size);
+    }
+  }
+  testCorrupt();
+  return testExitCode();
+}
@@ -0,0 +1,299 @@
+#include "memtransfer.hh"
+#include "common.hh"
+#include "shm.hh"
+
+#include <errno.h>
+#include <sys/mman.h>
+
+static void unmapRegion(void* data, size_t size) {
+  if (data != nullptr && size > 0) {
+    munmap(data, size);
+  }
+}
+
+static bool readHandleInfo(const void* src, size_t srcSize, ShmHandleInfo* info) {
+  if (srcSize != sizeof(ShmHandleInfo) || src == nullptr) {
+    return false;
+  }
+  memcpy(info, src, sizeof(ShmHandleInfo));
+  return true;
+}
+
+// client
+
+namespace {
+
+// ClientReadHandle receives data written by the server. In shared mode the server writes
+// directly into _data; in inline mode data updates are copied into _data.
+class ClientReadHandle : public dawn_wire::client::MemoryTransferService::ReadHandle {
+public:
+  ClientReadHandle(void* data, size_t size, uint32_t id)
+    : _data((char*)data), _size(size), _id(id) {}
+  ~ClientReadHandle() override {
+    if (_id != 0) {
+      unmapRegion(_data, _size);
+    } else {
+      free(_data);
+    }
+  }
+
+  size_t SerializeCreateSize() override {
+    return sizeof(ShmHandleInfo);
+  }
+  void SerializeCreate(void* serializePointer) override {
+    ShmHandleInfo info = {_id, _id == 0 ? SHM_HANDLE_INLINE : 0u, _size};
+    memcpy(serializePointer, &info, sizeof(info));
+  }
+  const void* GetData() override {
+    return _data;
+  }
+  bool DeserializeDataUpdate(const void* deserializePointer, size_t deserializeSize,
+                             size_t offset, size_t size) override {
+    if (offset > _size || size > _size - offset) {
+      return false;
+    }
+    if (_id != 0) {
+      return deserializeSize == 0; // already in _data
+    }
+    if (deserializeSize != size || deserializePointer == nullptr) {
+      return false;
+    }
+    memcpy(_data + offset, deserializePointer, size);
+    return true;
+  }
+
+private:
+  char* _data;
+  size_t _size;
+  uint32_t _id; // 0 for inline
+};
+
+// ClientWriteHandle holds data written by the client. In shared mode the server reads it
+// directly from the shared memory; in inline mode data updates carry a copy of the data.
+class ClientWriteHandle : public dawn_wire::client::MemoryTransferService::WriteHandle {
+public:
+  ClientWriteHandle(void* data, size_t size, uint32_t id)
+    : _data((char*)data), _size(size), _id(id) {}
+  ~ClientWriteHandle() override {
+    if (_id != 0) {
+      unmapRegion(_data, _size);
+    } else {
+      free(_data);
+    }
+  }
+
+  size_t SerializeCreateSize() override {
+    return sizeof(ShmHandleInfo);
+  }
+  void SerializeCreate(void* serializePointer) override {
+    ShmHandleInfo info = {_id, _id == 0 ? SHM_HANDLE_INLINE : 0u, _size};
+    memcpy(serializePointer, &info, sizeof(info));
+  }
+  void* GetData() override {
+    return _data;
+  }
+  size_t SizeOfSerializeDataUpdate(size_t offset, size_t size) override {
+    assert(offset <= _size && size <= _size - offset);
+    return _id != 0 ? 0 : size;
+  }
+  void SerializeDataUpdate(void* serializePointer, size_t offset, size_t size) override {
+    if (_id == 0) {
+      memcpy(serializePointer, _data + offset, size);
+    }
+  }
+
+private:
+  char* _data;
+  size_t _size;
+  uint32_t _id; // 0 for inline
+};
+
+} // namespace
+
+// createRegion creates, maps and sends a shared memory object of size bytes to the server.
+// Returns nullptr on failure, in which case the caller falls back to inline transfer.
+void* ShmTransferClient::createRegion(size_t size, uint32_t* idOut) {
+  if (size < minShmSize || !_proto.fdPassing || _proto.stopped()) {
+    return nullptr;
+  }
+  int fd = shmCreate("dawnbuf", size);
+  if (fd < 0) {
+    perror("shmCreate");
+    return nullptr;
+  }
+  void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    close(fd);
+    return nullptr;
+  }
+  uint32_t id = _nextId++;
+  if (_nextId == 0) {
+    _nextId = 1; // 0 means "inline"
+  }
+  if (!_proto.sendSharedMemory(id, size, fd)) { // takes ownership of fd
+    munmap(data, size);
+    return nullptr;
+  }
+  *idOut = id;
+  return data;
+}
+
+dawn_wire::client::MemoryTransferService::ReadHandle* ShmTransferClient::CreateReadHandle(
+  size_t size) {
+  uint32_t id = 0;
+  void* data = createRegion(size, &id);
+  if (data == nullptr && (data = malloc(std::max(size, (size_t)1))) == nullptr) {
+    return nullptr;
+  }
+  return new ClientReadHandle(data, size, id);
+}
+
+dawn_wire::client::MemoryTransferService::WriteHandle* ShmTransferClient::CreateWriteHandle(
+  size_t size) {
+  uint32_t id = 0;
+  void* data = createRegion(size, &id);
+  if (data == nullptr && (data = calloc(1, std::max(size, (size_t)1))) == nullptr) {
+    return nullptr;
+  }
+  return new ClientWriteHandle(data, size, id);
+}
+
+// server
+
+namespace {
+
+// ServerReadHandle sends data read from a mapped buffer to the client
+class ServerReadHandle : public dawn_wire::server::MemoryTransferService::ReadHandle {
+public:
+  explicit ServerReadHandle(const ShmTransferServer::Region& r) : _r(r) {}
+  ~ServerReadHandle() override {
+    unmapRegion(_r.data, _r.size);
+  }
+
+  size_t SizeOfSerializeDataUpdate(size_t offset, size_t size) override {
+    return _r.data != nullptr ? 0 : size;
+  }
+  void SerializeDataUpdate(const void* data, size_t offset, size_t size,
+                           void* serializePointer) override {
+    if (_r.data == nullptr) {
+      memcpy(serializePointer, data, size);
+    } else if (offset <= _r.size && size <= _r.size - offset) {
+      memcpy(_r.data + offset, data, size);
+    } else {
+      errlog("ServerReadHandle: update [%zu, %zu) out of bounds", offset, offset + size);
+    }
+  }
+
+private:
+  ShmTransferServer::Region _r; // data is nullptr for inline
+};
+
+// ServerWriteHandle copies data written by the client into a mapped buffer
+class ServerWriteHandle : public dawn_wire::server::MemoryTransferService::WriteHandle {
+public:
+  explicit ServerWriteHandle(const ShmTransferServer::Region& r) : _r(r) {}
+  ~ServerWriteHandle() override {
+    unmapRegion(_r.data, _r.size);
+  }
+
+  bool DeserializeDataUpdate(const void* deserializePointer, size_t deserializeSize,
+                             size_t offset, size_t size) override {
+    if (mTargetData == nullptr || offset > mDataLength || size > mDataLength - offset) {
+      return false;
+    }
+    const char* src;
+    if (_r.data == nullptr) {
+      if (deserializeSize != size || deserializePointer == nullptr) {
+        return false;
+      }
+      src = (const char*)deserializePointer;
+    } else {
+      if (deserializeSize != 0 || offset > _r.size || size > _r.size - offset) {
+        return false;
+      }
+      src = _r.data + offset;
+    }
+    memcpy((char*)mTargetData + offset, src, size);
+    return true;
+  }
+
+private:
+  ShmTransferServer::Region _r; // data is nullptr for inline
+};
+
+} // namespace
+
+ShmTransferServer::~ShmTransferServer() {
+  for (auto& it : _regions) {
+    unmapRegion(it.second.data, it.second.size);
+  }
+}
+
+bool ShmTransferServer::addRegion(uint32_t id, uint64_t size, int fd) {
+  if (size == 0) {
+    errlog("invalid shared memory region id=%u size=%llu", id, (unsigned long long)size);
+    close(fd);
+    return false;
+  }
+  // The client could otherwise send a smaller object, or truncate it later, and make us
+  // fault (SIGBUS) when we access the mapping
+  if (!shmCheck(fd, size)) {
+    errlog("rejecting shared memory region id=%u size=%llu: %s", id, (unsigned long long)size,
+           strerror(errno));
+    close(fd);
+    return false;
+  }
+  void* data = mmap(nullptr, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // the mapping keeps the memory object alive
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(_mu);
+  if (!_regions.emplace(id, Region{(char*)data, (size_t)size}).second) {
+    errlog("duplicate shared memory region id=%u", id);
+    unmapRegion(data, (size_t)size);
+    return false;
+  }
+  return true;
+}
+
+// takeRegion moves the region described by info out of _regions and into r.
+// For inline handles, r is left empty.
+bool ShmTransferServer::takeRegion(const ShmHandleInfo& info, Region* r) {
+  if (info.flags & SHM_HANDLE_INLINE) {
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(_mu);
+  auto it = _regions.find(info.id);
+  if (it == _regions.end() || it->second.size != info.size) {
+    errlog("unknown shared memory region id=%u", info.id);
+    return false;
+  }
+  *r = it->second;
+  _regions.erase(it);
+  return true;
+}
+
+bool ShmTransferServer::DeserializeReadHandle(const void* deserializePointer,
+                                              size_t deserializeSize, ReadHandle** readHandle) {
+  ShmHandleInfo info;
+  Region r;
+  if (!readHandleInfo(deserializePointer, deserializeSize, &info) || !takeRegion(info, &r)) {
+    return false;
+  }
+  *readHandle = new ServerReadHandle(r);
+  return true;
+}
+
+bool ShmTransferServer::DeserializeWriteHandle(const void* deserializePointer,
+                                               size_t deserializeSize, WriteHandle** writeHandle) {
+  ShmHandleInfo info;
+  Region r;
+  if (!readHandleInfo(deserializePointer, deserializeSize, &info) || !takeRegion(info, &r)) {
+    return false;
+  }
+  *writeHandle = new ServerWriteHandle(r);
+  return true;
+}
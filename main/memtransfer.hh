@@ -0,0 +1,70 @@
+#pragma once
+#include "protocol.hh"
+
+#include <dawn/wire/WireClient.h>
+#include <dawn/wire/WireServer.h>
+
+#include <mutex>
+#include <unordered_map>
+
+// Shared-memory MemoryTransferService for dawn_wire.
+//
+// Instead of copying mapped buffer contents through the command stream, the client
+// creates a shared memory object per read/write handle and passes its file descriptor
+// to the server with DawnRemoteProtocol::sendSharedMemory (SCM_RIGHTS). Both sides then
+// map the same memory; data updates only carry offsets.
+//
+// Handles smaller than ShmTransferClient::minShmSize, or for which shared memory can not
+// be set up, fall back to transferring data inline like Dawn's default service does.
+
+// ShmHandleInfo is the serialized "create" info of a handle
+struct ShmHandleInfo {
+  uint32_t id;    // region id (0 when inline)
+  uint32_t flags; // SHM_HANDLE_*
+  uint64_t size;  // nbytes of the handle's memory
+};
+#define SHM_HANDLE_INLINE 1u
+
+class ShmTransferClient : public dawn_wire::client::MemoryTransferService {
+public:
+  size_t minShmSize = 16 * 1024; // smaller handles use inline transfer
+
+  explicit ShmTransferClient(DawnRemoteProtocol& proto) : _proto(proto) {}
+
+  ReadHandle* CreateReadHandle(size_t size) override;
+  WriteHandle* CreateWriteHandle(size_t size) override;
+
+  // internal
+  void* createRegion(size_t size, uint32_t* idOut);
+
+private:
+  DawnRemoteProtocol& _proto;
+  uint32_t _nextId = 1;
+};
+
+class ShmTransferServer : public dawn_wire::server::MemoryTransferService {
+public:
+  ~ShmTransferServer() override;
+
+  // addRegion maps a shared memory object received from the client (see
+  // DawnRemoteProtocol::onSharedMemory.) Takes ownership of fd.
+  bool addRegion(uint32_t id, uint64_t size, int fd);
+
+  bool DeserializeReadHandle(const void* deserializePointer, size_t deserializeSize,
+                             ReadHandle** readHandle) override;
+  bool DeserializeWriteHandle(const void* deserializePointer, size_t deserializeSize,
+                              WriteHandle** writeHandle) override;
+
+  // internal
+  struct Region {
+    char* data = nullptr;
+    size_t size = 0;
+  };
+  bool takeRegion(const ShmHandleInfo& info, Region* r);
+
+private:
+  // Regions are added on the connection's I/O thread and taken while Dawn commands
+  // execute, which may be on another thread (see CommandExecutor)
+  std::mutex _mu; // protects _regions
+  std::unordered_map<uint32_t, Region> _regions; // received but not yet claimed by a handle
+};
@@ -0,0 +1,101 @@
+#include "metrics.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib> // atof
+
+uint64_t Histogram::count() const {
+  uint64_t n = 0;
+  for (const Counter& b : _buckets) {
+    n += b.get();
+  }
+  return n;
+}
+
+uint64_t Histogram::bucketMax(uint32_t i) {
+  if (i < HIST_SUB_BUCKETS) {
+    return i;
+  }
+  uint32_t e = i / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+  uint64_t sub = i % HIST_SUB_BUCKETS;
+  uint64_t width = 1ull << (e - HIST_SUB_BITS);
+  return (HIST_SUB_BUCKETS + sub) * width + (width - 1);
+}
+
+uint64_t Histogram::percentile(double p) const {
+  // The writer may be recording concurrently; count the buckets once and scan that snapshot
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < HIST_BUCKETS; i++) {
+    counts[i] = _buckets[i].get();
+    total += counts[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t rank = std::max((uint64_t)1, (uint64_t)std::ceil(p * (double)total));
+  uint64_t n = 0;
+  for (uint32_t i = 0; i < HIST_BUCKETS; i++) {
+    n += counts[i];
+    if (n >= rank) {
+      return std::min(bucketMax(i), max());
+    }
+  }
+  return max();
+}
+
+void MetricsWriter::type(const char* name, const char* type, const char* help) {
+  out += "# HELP ";
+  out += name;
+  out += ' ';
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += ' ';
+  out += type;
+  out += '\n';
+}
+
+static void writeName(std::string& out, const char* name, const char* suffix,
+                      const std::string& labels) {
+  out += name;
+  out += suffix;
+  if (!labels.empty()) {
+    out += '{';
+    out += labels;
+    out += '}';
+  }
+  out += ' ';
+}
+
+void MetricsWriter::value(const char* name, const std::string& labels, uint64_t v) {
+  writeName(out, name, "", labels);
+  out += std::to_string(v);
+  out += '\n';
+}
+
+void MetricsWriter::value(const char* name, const std::string& labels, double v) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.9g", v);
+  writeName(out, name, "", labels);
+  out += buf;
+  out += '\n';
+}
+
+void MetricsWriter::summary(const char* name, const std::string& labels, const Histogram& h,
+                            double scale) {
+  static const char* quantiles[] = {"0.5", "0.9", "0.99", "0.999", "1"};
+  std::string sep = labels.empty() ? "" : ",";
+  for (const char* q : quantiles) {
+    value(name, labels + sep + "quantile=\"" + q + "\"", (double)h.percentile(atof(q)) * scale);
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.9g", (double)h.sum() * scale);
+  writeName(out, name, "_sum", labels);
+  out += buf;
+  out += '\n';
+  writeName(out, name, "_count", labels);
+  out += std::to_string(h.count());
+  out += '\n';
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <time.h>
+
+// Metrics are updated on hot paths, so they are kept cheap: each Counter and Histogram has
+// a single writer thread, which updates it with plain relaxed loads and stores (no locked
+// read-modify-write instructions), while any other thread may read it at any time.
+
+// metricsNow returns a monotonic timestamp in nanoseconds
+inline uint64_t metricsNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+struct Counter {
+  std::atomic<uint64_t> v{0};
+
+  void add(uint64_t n) {
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+  uint64_t get() const {
+    return v.load(std::memory_order_relaxed);
+  }
+};
+
+// Histogram records values, e.g. latencies in nanoseconds, in log-linear buckets (like
+// HdrHistogram): every power of two is split into HIST_SUB_BUCKETS buckets, so values are
+// kept with a relative error of at most 1/HIST_SUB_BUCKETS across the whole uint64 range,
+// and record is a few instructions with no allocation.
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1u << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+class Histogram {
+public:
+  void record(uint64_t v) {
+    _buckets[bucketOf(v)].add(1);
+    _sum.add(v);
+    if (v > _max.get()) {
+      _max.v.store(v, std::memory_order_relaxed);
+    }
+  }
+
+  uint64_t count() const;
+  uint64_t sum() const {
+    return _sum.get();
+  }
+  uint64_t max() const {
+    return _max.get();
+  }
+
+  // percentile returns the smallest value that at least p (0-1) of the recorded values
+  // are less than or equal to, rounded up to its bucket's upper bound. 0 if empty.
+  uint64_t percentile(double p) const;
+
+  static uint32_t bucketOf(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS) {
+      return (uint32_t)v;
+    }
+    uint32_t e = 63 - (uint32_t)__builtin_clzll(v); // >= HIST_SUB_BITS
+    uint32_t sub = (uint32_t)(v >> (e - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+  }
+  static uint64_t bucketMax(uint32_t i);
+
+private:
+  Counter _buckets[HIST_BUCKETS];
+  Counter _sum;
+  Counter _max;
+};
+
+// MetricsWriter formats metrics in the Prometheus text exposition format
+struct MetricsWriter {
+  std::string out;
+
+  // type starts a metric family ("counter", "gauge" or "summary")
+  void type(const char* name, const char* type, const char* help);
+  // value writes a sample. labels is "" or a label list without braces, e.g. conn="3"
+  void value(const char* name, const std::string& labels, uint64_t v);
+  void value(const char* name, const std::string& labels, double v);
+  // summary writes quantiles, _sum and _count of h, with values multiplied by scale
+  // (e.g. 1e-9 to report nanoseconds as seconds)
+  void summary(const char* name, const std::string& labels, const Histogram& h, double scale);
+};
@@ -0,0 +1,114 @@
+#include "metrics.hh"
+#include "testutil.hh"
+
+#include <thread>
+
+// checkBucket checks that v lands in a bucket whose range includes it and whose upper
+// bound is within the histogram's relative error of v
+static void checkBucket(uint64_t v) {
+  uint32_t b = Histogram::bucketOf(v);
+  CHECK(b < HIST_BUCKETS);
+  CHECK(v <= Histogram::bucketMax(b));
+  CHECK(b == 0 || v > Histogram::bucketMax(b - 1));
+  CHECK(Histogram::bucketMax(b) - v <= v / HIST_SUB_BUCKETS);
+}
+
+static void testBuckets() {
+  for (uint64_t v = 0; v < 100000; v++) {
+    checkBucket(v);
+  }
+  for (int e = 0; e < 64; e++) {
+    uint64_t p = 1ull << e;
+    checkBucket(p - 1);
+    checkBucket(p);
+    checkBucket(p + 1);
+  }
+  for (int i = 0; i < 100000; i++) {
+    checkBucket(testRand() >> (testRand() % 64));
+  }
+  checkBucket(UINT64_MAX);
+  CHECK(Histogram::bucketOf(UINT64_MAX) == HIST_BUCKETS - 1);
+  CHECK(Histogram::bucketMax(HIST_BUCKETS - 1) == UINT64_MAX);
+  for (uint32_t b = 1; b < HIST_BUCKETS; b++) {
+    CHECK(Histogram::bucketMax(b) > Histogram::bucketMax(b - 1));
+  }
+}
+
+static void testPercentiles() {
+  Histogram h;
+  CHECK(h.count() == 0 && h.sum() == 0 && h.max() == 0);
+  CHECK(h.percentile(0.5) == 0);
+
+  for (uint64_t v = 1; v <= 1000; v++) {
+    h.record(v);
+  }
+  CHECK(h.count() == 1000);
+  CHECK(h.sum() == 500500);
+  CHECK(h.max() == 1000);
+  // percentiles are rounded up to their bucket's upper bound, and never exceed max
+  uint64_t p50 = h.percentile(0.5);
+  CHECK(p50 >= 500 && p50 <= 500 + 500 / HIST_SUB_BUCKETS);
+  uint64_t p99 = h.percentile(0.99);
+  CHECK(p99 >= 990 && p99 <= 1000);
+  CHECK(h.percentile(1) == 1000);
+  CHECK(h.percentile(0) == 1);
+
+  Histogram one;
+  one.record(12345);
+  CHECK(one.percentile(0.5) == 12345);
+  CHECK(one.percentile(0.999) == 12345);
+}
+
+// testConcurrentRead reads a histogram while another thread records into it, as the
+// stats endpoint does
+static void testConcurrentRead() {
+  Histogram h;
+  std::atomic<bool> done{false};
+  std::thread writer([&]() {
+    for (uint64_t i = 0; i < 1000000; i++) {
+      h.record(i % 5000);
+    }
+    done.store(true);
+  });
+  uint64_t last = 0;
+  while (!done.load()) {
+    uint64_t n = h.count();
+    CHECK(n >= last);
+    last = n;
+    CHECK(h.percentile(0.5) <= 5000);
+  }
+  writer.join();
+  CHECK(h.count() == 1000000);
+}
+
+static void testWriter() {
+  Histogram h;
+  h.record(1000);
+  h.record(3000);
+  MetricsWriter w;
+  w.type("t_seconds", "summary", "Test.");
+  w.summary("t_seconds", "conn=\"1\"", h, 1e-9);
+  w.value("t_total", "", (uint64_t)7);
+  const char* expect = "# HELP t_seconds Test.\n"
+                       "# TYPE t_seconds summary\n"
+                       "t_seconds{conn=\"1\",quantile=\"0.5\"} 1.023e-06\n"
+                       "t_seconds{conn=\"1\",quantile=\"0.9\"} 3e-06\n"
+                       "t_seconds{conn=\"1\",quantile=\"0.99\"} 3e-06\n"
+                       "t_seconds{conn=\"1\",quantile=\"0.999\"} 3e-06\n"
+                       "t_seconds{conn=\"1\",quantile=\"1\"} 3e-06\n"
+                       "t_seconds_sum{conn=\"1\"} 4e-06\n"
+                       "t_seconds_count{conn=\"1\"} 2\n"
+                       "t_total 7\n";
+  CHECK(w.out == expect);
+  if (w.out != expect) {
+    fprintf(stderr, "got:\n%s", w.out.c_str());
+  }
+}
+
+int main() {
+  testBuckets();
+  testPercentiles();
+  testConcurrentRead();
+  testWriter();
+  return testExitCode();
+}
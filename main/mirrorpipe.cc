@@ -0,0 +1,49 @@
+#include "mirrorpipe.hh"
+#include "shm.hh"
+
+#include <errno.h>
+#include <sys/mman.h>
+
+bool MirrorPipe::init(size_t minsize) {
+  dispose();
+
+  size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = ((minsize + pagesize - 1) / pagesize) * pagesize;
+
+  int fd = shmCreate("mirrorpipe", size);
+  if (fd < 0) {
+    return false;
+  }
+
+  // Reserve address space for two copies, then map the shared memory object into each half
+  char* p = (char*)mmap(nullptr, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (p == MAP_FAILED) {
+    int e = errno;
+    close(fd);
+    errno = e;
+    return false;
+  }
+  if (mmap(p, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+      mmap(p + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    int e = errno;
+    munmap(p, size * 2);
+    close(fd);
+    errno = e;
+    return false;
+  }
+  close(fd); // the mappings keep the memory object alive
+
+  _storage = p;
+  _size = size;
+  clear();
+  return true;
+}
+
+void MirrorPipe::dispose() {
+  if (_storage != nullptr) {
+    munmap(_storage, _size * 2);
+    _storage = nullptr;
+    _size = 0;
+  }
+  clear();
+}
@@ -0,0 +1,181 @@
+#pragma once
+#include "pipe.hh"
+
+// MirrorPipe is a circular read-write buffer with the same interface as Pipe.
+// Its storage is a shared memory object mapped twice, back to back, into virtual memory,
+// so that every byte of the ring is also visible at storage[offset + size]:
+//
+//   memory:  0 1 2 3 4 5 6 7 | 0 1 2 3 4 5 6 7   (second half mirrors the first)
+//   len: 5             |     w                    (r=5, w=2)
+//                      r
+//
+// Any span of up to cap() bytes starting at the read or write offset is thus contiguous
+// in memory: takeRef never fails and reads & writes never have to be split in two.
+// init must be called (and succeed) before the pipe is used.
+struct MirrorPipe {
+  char* _storage = nullptr; // 2 * _size bytes of address space
+  size_t _size = 0;         // size of the ring (a multiple of the page size)
+  size_t _r = 0;            // storage read offset (always < _size)
+  size_t _len = 0;          // number of bytes waiting to be read
+
+#ifdef DEBUG
+  const char* _debugname = "buf";
+#endif
+
+  MirrorPipe() = default;
+  MirrorPipe(const MirrorPipe&) = delete;
+  MirrorPipe& operator=(const MirrorPipe&) = delete;
+  ~MirrorPipe() {
+    dispose();
+  }
+
+  // init allocates storage for at least minsize bytes, rounded up to the page size.
+  // Returns false on failure with errno set.
+  bool init(size_t minsize);
+  void dispose(); // release storage
+  bool initialized() const {
+    return _storage != nullptr;
+  }
+
+  size_t cap() const {
+    return _size;
+  }
+  size_t len() const {
+    return _len;
+  }
+  size_t avail() const {
+    return _size - _len;
+  }
+
+  // add data to the beginning of the pipe
+  size_t write(const char* src, size_t nbyte); // copy <=nbyte of dst into the pipe
+  size_t writec(char c);                       // add c to the pipe
+  ssize_t readFromFD(int fd, size_t nbyte);    // read <=nbyte from file (-1 on error)
+
+  // take data out of the end of the pipe
+  size_t read(char* dst, size_t nbyte);    // copy <=nbyte of data to dst
+  size_t discard(size_t nbyte);            // read & discard
+  ssize_t writeToFD(int fd, size_t nbyte); // write <=nbyte to file (-1 on error)
+
+  // iovec access for vectored I/O. Since storage is mirrored, at most one iovec is used.
+  int dataIOVecs(struct iovec iov[2], size_t nbyte) const;
+  int spaceIOVecs(struct iovec iov[2], size_t nbyte) const;
+  size_t commit(size_t nbyte);
+
+  // takeRef removes nbyte and returns a pointer to the removed bytes.
+  // Unlike Pipe::takeRef, this only returns nullptr when nbyte > len().
+  // The returned memory is only valid until the next call to write() or clear().
+  const char* takeRef(size_t nbyte);
+
+  inline char at(size_t index) const {
+    return _storage[_r + index];
+  }
+
+  void clear() {
+    _r = 0;
+    _len = 0;
+  }
+
+  // internal
+  inline size_t woffs() const {
+    return (_r + _len) % _size;
+  }
+};
+
+inline size_t MirrorPipe::write(const char* data, size_t nbyte) {
+  nbyte = std::min(nbyte, avail());
+  PipeTrace("write", data, nbyte);
+  memcpy(_storage + woffs(), data, nbyte);
+  _len += nbyte;
+  return nbyte;
+}
+
+inline size_t MirrorPipe::writec(char c) {
+#ifdef DEBUG_TRACE_PIPE
+  char tmp[1] = {c};
+  PipeTrace("writec", tmp, std::min((size_t)1, avail()));
+#endif
+  if (avail() == 0) {
+    return 0;
+  }
+  _storage[woffs()] = c;
+  _len++;
+  return 1;
+}
+
+inline int MirrorPipe::dataIOVecs(struct iovec iov[2], size_t nbyte) const {
+  nbyte = std::min(nbyte, len());
+  if (nbyte == 0) {
+    return 0;
+  }
+  iov[0].iov_base = (void*)&_storage[_r];
+  iov[0].iov_len = nbyte;
+  return 1;
+}
+
+inline int MirrorPipe::spaceIOVecs(struct iovec iov[2], size_t nbyte) const {
+  nbyte = std::min(nbyte, avail());
+  if (nbyte == 0) {
+    return 0;
+  }
+  iov[0].iov_base = (void*)&_storage[woffs()];
+  iov[0].iov_len = nbyte;
+  return 1;
+}
+
+inline size_t MirrorPipe::commit(size_t nbyte) {
+  nbyte = std::min(nbyte, avail());
+  PipeTrace("commit", _storage + woffs(), nbyte);
+  _len += nbyte;
+  return nbyte;
+}
+
+inline ssize_t MirrorPipe::readFromFD(int fd, size_t nbyte) {
+  nbyte = std::min(nbyte, avail());
+  if (nbyte == 0) {
+    return 0;
+  }
+  ssize_t n = ::read(fd, _storage + woffs(), nbyte);
+  if (n > 0) {
+    commit((size_t)n);
+  }
+  return n;
+}
+
+inline size_t MirrorPipe::read(char* data, size_t nbyte) {
+  nbyte = std::min(nbyte, len());
+  memcpy(data, _storage + _r, nbyte);
+  PipeTrace("read", data, nbyte);
+  return discard(nbyte);
+}
+
+inline ssize_t MirrorPipe::writeToFD(int fd, size_t nbyte) {
+  nbyte = std::min(nbyte, len());
+  if (nbyte == 0) {
+    return 0;
+  }
+  ssize_t n = ::write(fd, _storage + _r, nbyte);
+  if (n > 0) {
+    PipeTrace("writeToFD", _storage + _r, (size_t)n);
+    discard((size_t)n);
+  }
+  return n;
+}
+
+inline size_t MirrorPipe::discard(size_t nbyte) {
+  nbyte = std::min(nbyte, len());
+  _r = (_r + nbyte) % _size;
+  _len -= nbyte;
+  return nbyte;
+}
+
+inline const char* MirrorPipe::takeRef(size_t nbyte) {
+  if (nbyte > len()) {
+    PipeTrace("takeRef", NULL, 0);
+    return nullptr;
+  }
+  const char* p = _storage + _r;
+  PipeTrace("takeRef", p, nbyte);
+  discard(nbyte);
+  return p;
+}
@@ -0,0 +1,66 @@
+#include "mirrorpipe.hh"
+#include "testutil.hh"
+
+#include <string.h>
+#include <vector>
+
+// testStream runs a byte stream through a MirrorPipe (see testPipeStream)
+static void testStream() {
+  MirrorPipe p;
+  CHECK(!p.initialized());
+  if (!p.init(1)) {
+    perror("MirrorPipe::init");
+    CHECK(false);
+    return;
+  }
+  size_t cap = p.cap();
+  CHECK(cap >= 1 && cap % (size_t)sysconf(_SC_PAGESIZE) == 0);
+  testPipeStream(p, 5000);
+  p.dispose();
+  CHECK(!p.initialized() && p.len() == 0);
+}
+
+// testWrap checks that data and space which wrap around the end of the ring are still
+// contiguous: through at, takeRef and a single iovec
+static void testWrap() {
+  MirrorPipe p;
+  if (!p.init(1)) {
+    perror("MirrorPipe::init");
+    CHECK(false);
+    return;
+  }
+  size_t cap = p.cap();
+  std::vector<char> buf(cap);
+  for (size_t k = 0; k < cap; k++) {
+    buf[k] = testByteAt(k);
+  }
+  CHECK(p.write(buf.data(), cap - 10) == cap - 10);
+  CHECK(p.read(buf.data(), cap - 10) == cap - 10); // next read at storage[cap - 10]
+
+  // data from storage[cap - 10] to storage[89]
+  CHECK(p.write(buf.data(), 100) == 100);
+  struct iovec iov[2];
+  CHECK(p.dataIOVecs(iov, 100) == 1 && iov[0].iov_len == 100);
+  CHECK(iov[0].iov_base != nullptr && memcmp(iov[0].iov_base, buf.data(), 100) == 0);
+  for (size_t k = 0; k < 100; k++) {
+    CHECK(p.at(k) == testByteAt(k));
+  }
+  const char* ref = p.takeRef(100);
+  CHECK(ref != nullptr && memcmp(ref, buf.data(), 100) == 0);
+  CHECK(p.len() == 0);
+
+  // space from storage[90] to storage[69]
+  CHECK(p.spaceIOVecs(iov, cap - 20) == 1 && iov[0].iov_len == cap - 20);
+  memcpy(iov[0].iov_base, buf.data(), cap - 20);
+  CHECK(p.commit(cap - 20) == cap - 20);
+  std::vector<char> out(cap);
+  CHECK(p.read(out.data(), cap) == cap - 20);
+  CHECK(memcmp(out.data(), buf.data(), cap - 20) == 0);
+  p.dispose();
+}
+
+int main() {
+  testStream();
+  testWrap();
+  return testExitCode();
+}
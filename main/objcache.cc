@@ -0,0 +1,246 @@
+#include "objcache.hh"
+
+#include <mutex>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+
+// ObjCache maps a description of an object to the object, and counts the references given
+// out to it. T is a WGPU handle type.
+template <typename T> struct ObjCache {
+  struct Entry {
+    std::string key;
+    uint64_t refs;
+  };
+  std::unordered_map<std::string, T> byKey;
+  std::unordered_map<T, Entry> byObj;
+  ObjectCacheCounts counts;
+
+  // lookup returns a new reference to the object for key, or nullptr
+  T lookup(const std::string& key) {
+    auto it = byKey.find(key);
+    if (it == byKey.end()) {
+      counts.misses++;
+      return nullptr;
+    }
+    counts.hits++;
+    byObj[it->second].refs++;
+    return it->second;
+  }
+
+  // add caches obj, created after lookup missed, under key. Returns obj, or the object
+  // another thread added for key while obj was being created, in which case the caller
+  // takes a reference to that one and releases obj.
+  T add(const std::string& key, T obj) {
+    if (obj == nullptr) {
+      return obj;
+    }
+    auto k = byKey.find(key);
+    if (k != byKey.end()) {
+      byObj[k->second].refs++;
+      return k->second;
+    }
+    auto it = byObj.find(obj);
+    if (it != byObj.end()) {
+      it->second.refs++; // Dawn returned a live object, already cached under another key
+      return obj;
+    }
+    byKey.emplace(key, obj);
+    byObj.emplace(obj, Entry{key, 1});
+    return obj;
+  }
+
+  void reference(T obj) {
+    auto it = byObj.find(obj);
+    if (it != byObj.end()) {
+      it->second.refs++;
+    }
+  }
+
+  void release(T obj) {
+    auto it = byObj.find(obj);
+    if (it != byObj.end() && --it->second.refs == 0) {
+      byKey.erase(it->second.key);
+      byObj.erase(it);
+    }
+  }
+
+  ObjectCacheCounts stats() const {
+    ObjectCacheCounts c = counts;
+    c.entries = byObj.size();
+    return c;
+  }
+};
+
+static std::mutex _mu; // protects everything below
+static DawnProcTable _next; // original procs
+static ObjCache<WGPUShaderModule> _shaderModules;
+static ObjCache<WGPUComputePipeline> _computePipelines;
+
+static void keyAppend(std::string& key, const void* p, size_t size) {
+  key.append((const char*)p, size);
+}
+
+template <typename T> static void keyAppend(std::string& key, T v) {
+  keyAppend(key, &v, sizeof(v));
+}
+
+static void keyAppendStr(std::string& key, const char* s) {
+  size_t len = s != nullptr ? strlen(s) : 0;
+  keyAppend(key, len);
+  keyAppend(key, s, len);
+}
+
+// shaderModuleKey sets *key to a description of a shader module. Returns false if the
+// descriptor has extensions we don't know of; such modules are not cached.
+static bool shaderModuleKey(WGPUDevice device, const WGPUShaderModuleDescriptor* d,
+                            std::string* key) {
+  const WGPUChainedStruct* chain = d->nextInChain;
+  if (chain == nullptr || chain->next != nullptr) {
+    return false;
+  }
+  keyAppend(*key, device);
+  keyAppend(*key, chain->sType);
+  switch (chain->sType) {
+    case WGPUSType_ShaderModuleWGSLDescriptor:
+      keyAppendStr(*key, ((const WGPUShaderModuleWGSLDescriptor*)chain)->code);
+      return true;
+    case WGPUSType_ShaderModuleSPIRVDescriptor: {
+      auto spirv = (const WGPUShaderModuleSPIRVDescriptor*)chain;
+      keyAppend(*key, spirv->code, spirv->codeSize * sizeof(uint32_t));
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// computePipelineKey sets *key to a description of a compute pipeline. Layouts and modules
+// are identified by pointer; Dawn returns the same layout object for identical descriptors.
+static bool computePipelineKey(WGPUDevice device, const WGPUComputePipelineDescriptor* d,
+                               std::string* key) {
+  if (d->nextInChain != nullptr || d->compute.nextInChain != nullptr) {
+    return false;
+  }
+  keyAppend(*key, device);
+  keyAppend(*key, d->layout);
+  keyAppend(*key, d->compute.module);
+  keyAppendStr(*key, d->compute.entryPoint);
+  for (size_t i = 0; i < d->compute.constantCount; i++) {
+    if (d->compute.constants[i].nextInChain != nullptr) {
+      return false;
+    }
+    keyAppendStr(*key, d->compute.constants[i].key);
+    keyAppend(*key, d->compute.constants[i].value);
+  }
+  return true;
+}
+
+static WGPUShaderModule createShaderModule(WGPUDevice device,
+                                           const WGPUShaderModuleDescriptor* descriptor) {
+  std::string key;
+  if (!shaderModuleKey(device, descriptor, &key)) {
+    return _next.deviceCreateShaderModule(device, descriptor);
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    if (WGPUShaderModule m = _shaderModules.lookup(key)) {
+      _next.shaderModuleReference(m);
+      return m;
+    }
+  }
+  // create without holding _mu, then check that no other thread added one meanwhile
+  WGPUShaderModule m = _next.deviceCreateShaderModule(device, descriptor);
+  WGPUShaderModule cached;
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    cached = _shaderModules.add(key, m);
+    if (cached != m) {
+      _next.shaderModuleReference(cached);
+    }
+  }
+  if (cached != m) {
+    _next.shaderModuleRelease(m);
+  }
+  return cached;
+}
+
+static void shaderModuleReference(WGPUShaderModule m) {
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    _shaderModules.reference(m);
+  }
+  _next.shaderModuleReference(m);
+}
+
+static void shaderModuleRelease(WGPUShaderModule m) {
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    _shaderModules.release(m);
+  }
+  _next.shaderModuleRelease(m);
+}
+
+static WGPUComputePipeline createComputePipeline(
+  WGPUDevice device, const WGPUComputePipelineDescriptor* descriptor) {
+  std::string key;
+  if (!computePipelineKey(device, descriptor, &key)) {
+    return _next.deviceCreateComputePipeline(device, descriptor);
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    if (WGPUComputePipeline p = _computePipelines.lookup(key)) {
+      _next.computePipelineReference(p);
+      return p;
+    }
+  }
+  // create without holding _mu, then check that no other thread added one meanwhile
+  WGPUComputePipeline p = _next.deviceCreateComputePipeline(device, descriptor);
+  WGPUComputePipeline cached;
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    cached = _computePipelines.add(key, p);
+    if (cached != p) {
+      _next.computePipelineReference(cached);
+    }
+  }
+  if (cached != p) {
+    _next.computePipelineRelease(p);
+  }
+  return cached;
+}
+
+static void computePipelineReference(WGPUComputePipeline p) {
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    _computePipelines.reference(p);
+  }
+  _next.computePipelineReference(p);
+}
+
+static void computePipelineRelease(WGPUComputePipeline p) {
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    _computePipelines.release(p);
+  }
+  _next.computePipelineRelease(p);
+}
+
+void objectCacheInstall(DawnProcTable* procs) {
+  std::lock_guard<std::mutex> lock(_mu);
+  _next = *procs;
+  procs->deviceCreateShaderModule = createShaderModule;
+  procs->shaderModuleReference = shaderModuleReference;
+  procs->shaderModuleRelease = shaderModuleRelease;
+  procs->deviceCreateComputePipeline = createComputePipeline;
+  procs->computePipelineReference = computePipelineReference;
+  procs->computePipelineRelease = computePipelineRelease;
+}
+
+ObjectCacheStats objectCacheStats() {
+  std::lock_guard<std::mutex> lock(_mu);
+  ObjectCacheStats s;
+  s.shaderModules = _shaderModules.stats();
+  s.computePipelines = _computePipelines.stats();
+  return s;
+}
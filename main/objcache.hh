@@ -0,0 +1,31 @@
+#pragma once
+#include <dawn/dawn_proc_table.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The object cache shares shader modules and compute pipelines between wire clients.
+// Creating an object that is identical to a live one (same device, same WGSL or SPIR-V
+// source; same module, entry point, constants and layout) returns a new reference to the
+// existing object instead of parsing and compiling it again. An entry is removed when the
+// last reference to its object is released, e.g. when the last client using it disconnects.
+//
+// Note: a client that recreates an invalid shader module gets the shared error object, but
+// not its validation message.
+
+struct ObjectCacheCounts {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  size_t entries = 0; // live cached objects
+};
+
+struct ObjectCacheStats {
+  ObjectCacheCounts shaderModules;
+  ObjectCacheCounts computePipelines;
+};
+
+// objectCacheInstall replaces the shader module and compute pipeline procs of procs with
+// caching versions that call the original procs. Call once, before procs is used.
+void objectCacheInstall(DawnProcTable* procs);
+
+ObjectCacheStats objectCacheStats();
@@ -3,8 +3,12 @@
 #include <stdio.h>
 
 void _PipeTrace(const char* name, const char* prefix, const char* data, size_t datalen) {
+  if (data == nullptr) {
+    fprintf(stderr, "%s  %s  %zu\n", name, prefix, datalen);
+    return;
+  }
   char* buf = (char*)malloc(datalen * 5);
-  ssize_t n = data != nullptr ? debugFmtBytes(buf, datalen * 5, data, datalen) : 0;
+  ssize_t n = debugFmtBytes(buf, datalen * 5, data, datalen);
   if (n != -1) {
     if (n > 80) {
       fprintf(stderr, "%s  %s  %zu\n\"%s\"\n", name, prefix, datalen, buf);
@@ -2,7 +2,8 @@
 #include <algorithm>
 #include <cstring>
 #include <limits>
-#include <unistd.h> // read, write, close
+#include <sys/uio.h> // readv, writev, iovec
+#include <unistd.h>  // read, write, close
 #include <vector>
 
 // DEBUG_TRACE_PIPE: define to enable verbose tracing of input and output data
@@ -72,6 +73,12 @@ template <size_t Size> struct Pipe {
   size_t discard(size_t nbyte);            // read & discard
   ssize_t writeToFD(int fd, size_t nbyte); // write <=nbyte to file (-1 on error)
 
+  // iovec access for vectored I/O (readv, writev, sendmsg etc.)
+  // Each returns the number of iovecs populated in iov (0, 1 or 2.)
+  int dataIOVecs(struct iovec iov[2], size_t nbyte) const;  // <=nbyte of data waiting to be read
+  int spaceIOVecs(struct iovec iov[2], size_t nbyte) const; // <=nbyte of free space
+  size_t commit(size_t nbyte); // add nbyte written directly to space from spaceIOVecs
+
   // takeRef removes nbyte and returns a pointer to the removed bytes,
   // if and only if the next nbytes are contiguous, i.e. does not span across the
   // underlying ring buffer's head & tail. Returns nullptr on failure.
@@ -114,32 +121,63 @@ template <size_t Size> size_t Pipe<Size>::writec(char c) {
 
 size_t writec(char c);
 
-template <size_t Size> ssize_t Pipe<Size>::readFromFD(int fd, size_t nbyte) {
+template <size_t Size>
+int Pipe<Size>::dataIOVecs(struct iovec iov[2], size_t nbyte) const {
+  nbyte = std::min(nbyte, len());
+  size_t chunkend = std::min(nbyte, Size - _r);
+  int n = 0;
+  if (chunkend > 0) {
+    iov[n].iov_base = (void*)&_storage[_r];
+    iov[n++].iov_len = chunkend;
+  }
+  if (nbyte > chunkend) {
+    iov[n].iov_base = (void*)&_storage[0];
+    iov[n++].iov_len = nbyte - chunkend;
+  }
+  return n;
+}
+
+template <size_t Size>
+int Pipe<Size>::spaceIOVecs(struct iovec iov[2], size_t nbyte) const {
   nbyte = std::min(nbyte, avail());
   size_t chunkend = std::min(nbyte, Size - _w);
-  ssize_t total = 0;
+  int n = 0;
   if (chunkend > 0) {
-    total = ::read(fd, _storage + _w, chunkend);
-    PipeTrace("readFromFD", _storage + _w, (size_t)(total < 0 ? 0 : total));
-    if (total < (ssize_t)chunkend) {
-      // short read
-      if (total > -1) {
-        goto end;
-      }
-      return total;
-    }
+    iov[n].iov_base = (void*)&_storage[_w];
+    iov[n++].iov_len = chunkend;
+  }
+  if (nbyte > chunkend) {
+    iov[n].iov_base = (void*)&_storage[0];
+    iov[n++].iov_len = nbyte - chunkend;
   }
+  return n;
+}
+
+template <size_t Size> size_t Pipe<Size>::commit(size_t nbyte) {
+  nbyte = std::min(nbyte, avail());
+#ifdef DEBUG_TRACE_PIPE
+  size_t chunkend = std::min(nbyte, Size - _w);
+  PipeTrace("commit", _storage + _w, chunkend);
   if (nbyte > chunkend) {
-    ssize_t n = ::read(fd, _storage, nbyte - chunkend);
-    PipeTrace("readFromFD", _storage, (size_t)(n < 0 ? 0 : n));
-    if (n < 0) {
-      return n;
-    }
-    total += n;
-  }
-end:
-  _w = (_w + (size_t)total) % Size;
-  return total;
+    PipeTrace("commit", _storage, nbyte - chunkend);
+  }
+#endif
+  _w = (_w + nbyte) % Size;
+  return nbyte;
+}
+
+// readFromFD fills up to both free segments of the ring with a single readv call
+template <size_t Size> ssize_t Pipe<Size>::readFromFD(int fd, size_t nbyte) {
+  struct iovec iov[2];
+  int iovcnt = spaceIOVecs(iov, nbyte);
+  if (iovcnt == 0) {
+    return 0;
+  }
+  ssize_t n = ::readv(fd, iov, iovcnt);
+  if (n > 0) {
+    commit((size_t)n);
+  }
+  return n;
 }
 
 template <size_t Size> size_t Pipe<Size>::read(char* data, size_t nbyte) {
@@ -157,32 +195,19 @@ template <size_t Size> size_t Pipe<Size>::read(char* data, size_t nbyte) {
   return nbyte;
 }
 
+// writeToFD drains up to both data segments of the ring with a single writev call
 template <size_t Size> ssize_t Pipe<Size>::writeToFD(int fd, size_t nbyte) {
-  nbyte = std::min(nbyte, len());
-  size_t chunkend = std::min(nbyte, Size - _r);
-  ssize_t total = 0;
-  if (chunkend > 0) {
-    total = ::write(fd, _storage + _r, chunkend);
-    PipeTrace("writeToFD", _storage + _r, (size_t)(total < 0 ? 0 : total));
-    if (total < (ssize_t)chunkend) {
-      // short write
-      if (total > -1) {
-        goto end;
-      }
-      return total;
-    }
+  struct iovec iov[2];
+  int iovcnt = dataIOVecs(iov, nbyte);
+  if (iovcnt == 0) {
+    return 0;
   }
-  if (nbyte > chunkend) {
-    ssize_t n = ::write(fd, _storage, nbyte - chunkend);
-    PipeTrace("writeToFD", _storage, (size_t)(n < 0 ? 0 : n));
-    if (n < 0) {
-      return n;
-    }
-    total += n;
-  }
-end:
-  _r = (_r + nbyte) % Size;
-  return total;
+  ssize_t n = ::writev(fd, iov, iovcnt);
+  if (n > 0) {
+    PipeTrace("writeToFD", (const char*)iov[0].iov_base, std::min((size_t)n, iov[0].iov_len));
+    discard((size_t)n);
+  }
+  return n;
 }
 
 template <size_t Size> size_t Pipe<Size>::discard(size_t nbyte) {
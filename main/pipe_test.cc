@@ -0,0 +1,67 @@
+#include "pipe.hh"
+#include "testutil.hh"
+
+#include <string.h>
+
+// testStream runs a byte stream through a Pipe<Size> (see testPipeStream)
+template <size_t Size> static void testStream() {
+  Pipe<Size> p;
+  testPipeStream(p, 20000);
+}
+
+// testEdges checks full and empty pipes, and writes that end exactly at the end of storage
+static void testEdges() {
+  Pipe<8> p;
+  char buf[16];
+  CHECK(p.cap() == 7);
+  CHECK(p.read(buf, 1) == 0);
+  CHECK(p.write("abcdefghij", 10) == 7); // full
+  CHECK(p.avail() == 0);
+  CHECK(p.writec('x') == 0);
+  struct iovec iov[2];
+  CHECK(p.spaceIOVecs(iov, 10) == 0);
+  CHECK(p.read(buf, 5) == 5 && memcmp(buf, "abcde", 5) == 0);
+  CHECK(p.write("klmno", 5) == 5); // fills storage[7] and wraps to storage[0..3]
+  CHECK(p.dataIOVecs(iov, 100) == 2);
+  CHECK(iov[0].iov_len + iov[1].iov_len == 7);
+  CHECK(p.takeRef(7) == nullptr && p.len() == 7); // only succeeds for data that doesn't wrap
+  const char* ref = p.takeRef(3);
+  CHECK(ref != nullptr && memcmp(ref, "fgk", 3) == 0);
+  CHECK(p.read(buf, 4) == 4 && memcmp(buf, "lmno", 4) == 0);
+  CHECK(p.len() == 0);
+  p.clear();
+  CHECK(p.len() == 0 && p.avail() == 7);
+}
+
+// testWrapFD checks readFromFD and writeToFD with data that wraps around the end of
+// storage, which they read and write with two iovecs
+static void testWrapFD() {
+  Pipe<8> p;
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    CHECK(false);
+    return;
+  }
+  char buf[16];
+  CHECK(p.write("abcde", 5) == 5 && p.read(buf, 5) == 5); // start at storage[5]
+  struct iovec iov[2];
+  CHECK(p.spaceIOVecs(iov, 7) == 2);
+  CHECK(write(fds[1], "0123456", 7) == 7);
+  CHECK(p.readFromFD(fds[0], 7) == 7);
+  CHECK(p.dataIOVecs(iov, 7) == 2);
+  CHECK(p.writeToFD(fds[1], 7) == 7);
+  CHECK(read(fds[0], buf, 7) == 7 && memcmp(buf, "0123456", 7) == 0);
+  CHECK(p.len() == 0);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+int main() {
+  testEdges();
+  testWrapFD();
+  testStream<8>();
+  testStream<100>();
+  testStream<4096>();
+  return testExitCode();
+}
@@ -1,40 +1,21 @@
 #include "protocol.hh"
 #include "debug.hh"
+#include "log.hh"
+#include "lz.hh"
 
 #include <arpa/inet.h>
 #include <cstdio>
 #include <ctype.h> // isprint
 #include <errno.h>
 #include <fcntl.h> // F_GETFL, O_NONBLOCK etc
+#include <new>     // placement new
 #include <sys/socket.h>
+#include <sys/uio.h> // writev
 #include <sys/un.h>
 #include <unistd.h> // pipe
 
 #define DLOG_PREFIX "[proto] "
 
-#if defined(DEBUG)
-#define dlog(format, ...)                                                                          \
-  ({                                                                                               \
-    fprintf(stderr, DLOG_PREFIX format " \e[2m(%s %d)\e[0m\n", ##__VA_ARGS__, __FUNCTION__,        \
-            __LINE__);                                                                             \
-    fflush(stderr);                                                                                \
-  })
-#define errlog(format, ...)                                                                        \
-  (({                                                                                              \
-    fprintf(stderr, "E " format " (%s:%d)\n", ##__VA_ARGS__, __FILE__, __LINE__);                  \
-    fflush(stderr);                                                                                \
-  }))
-#else
-#define dlog(...)                                                                                  \
-  do {                                                                                             \
-  } while (0)
-#define errlog(format, ...)                                                                        \
-  (({                                                                                              \
-    fprintf(stderr, "E " format "\n", ##__VA_ARGS__);                                              \
-    fflush(stderr);                                                                                \
-  }))
-#endif
-
 #if defined(DEBUG_TRACE_PROTOCOL)
 #define trace(format, ...)                                                                         \
   ({                                                                                               \
@@ -58,31 +39,70 @@
 // protocol messages
 //
 // message        = metaMsg | frameMsg | dawncmdMsg
+// helloMsg       = "H" features
 // frameInfoMsg   = "I" <TODO DATA>
-// frameSignalMsg = "F"
+// frameSignalMsg = "F"          (same as a creditsMsg granting one credit)
+// creditsMsg     = "C" count
+// frameEndMsg    = "E"
 // reservationMsg = "R" <TODO DATA>
 // dawncmdMsg     = "D" size
+// dawnstreamMsg  = "S" size
+// dawncmdZMsg    = "Z" size rawsize
+// shmMsg         = "M" id size64   (with a file descriptor attached; SCM_RIGHTS)
 // size           = <uint32 in big-endian order>
+// rawsize        = <uint32 in big-endian order>
+// features       = <uint32 in big-endian order>
+// count          = <uint32 in big-endian order>
+// id             = <uint32 in big-endian order>
+// size64         = <uint64 in big-endian order>
+//
+// dawncmdMsg payloads must fit in the receiver's read buffer and are handed to onDawnBuffer
+// straight from there. dawnstreamMsg is used for larger payloads, which are streamed through
+// the read buffer into a separate buffer of the full size before being passed on.
+// dawncmdZMsg is an LZ-compressed dawncmdMsg (see lz.hh), only sent once both ends have
+// announced FeatureCompression with a helloMsg. size is the compressed size.
 //
-#define MSGT_FB_INFO 'I'      /* Framebuffer info */
-#define MSGT_FRAME_SIGNAL 'F' /* Frame signal */
-#define MSGT_RESERVATION 'R'  /* Device and Swapchain reservations */
-#define MSGT_DAWNCMD 'D'      /* Dawn command buffer */
+#define MSGT_FB_INFO 'I'        /* Framebuffer info */
+#define MSGT_FRAME_SIGNAL 'F'   /* Frame signal */
+#define MSGT_RESERVATION 'R'    /* Device and Swapchain reservations */
+#define MSGT_DAWNCMD 'D'        /* Dawn command buffer */
+#define MSGT_DAWNCMD_STREAM 'S' /* Dawn command buffer larger than the read buffer */
+#define MSGT_SHM 'M'            /* Shared memory object */
+#define MSGT_HELLO 'H'          /* Supported protocol features */
+#define MSGT_DAWNCMD_Z 'Z'      /* Compressed Dawn command buffer */
+#define MSGT_FRAME_CREDITS 'C'  /* Frame credits granted to the client */
+#define MSGT_FRAME_END 'E'      /* End of a client frame */
 
 // FB_INFO_SIZE is the number of bytes occupied by encoded framebuffer info
 #define FB_INFO_SIZE sizeof(DawnRemoteProtocol::FramebufferInfo)
 
 #define RESERVATION_SIZE (sizeof(dawn_wire::ReservedDevice) + sizeof(dawn_wire::ReservedSwapChain))
 
-// encodeDawnCmdHeader writes a MSGT_DAWNCMD header of DAWNCMD_MSG_HEADER_SIZE bytes to dst.
-static void encodeDawnCmdHeader(char* dst, uint32_t dawncmdlen) {
-  dst[0] = MSGT_DAWNCMD;
+#define SHM_MSG_SIZE 13 /* "M" id size64 */
+#define HELLO_MSG_SIZE 5 /* "H" features */
+#define CREDITS_MSG_SIZE 5 /* "C" count */
+
+#define FRAME_DRAIN_WEIGHT 0.125 /* weight of a new sample in frameDrainTime */
+
+// max number of file descriptors received per read
+#define RECV_FDS_MAX 16
+
+// encodeDawnCmdHeader writes a MSGT_DAWNCMD, MSGT_DAWNCMD_STREAM or MSGT_DAWNCMD_Z header
+// of DAWNCMD_MSG_HEADER_SIZE bytes to dst. rawlen is only used by MSGT_DAWNCMD_Z.
+static void encodeDawnCmdHeader(char* dst, char msgtype, uint32_t dawncmdlen,
+                                uint32_t rawlen = 0) {
+  dst[0] = msgtype;
   *((uint32_t*)&dst[1]) = htonl(dawncmdlen);
+  *((uint32_t*)&dst[5]) = htonl(rawlen);
 }
 
-static void decodeDawnCmdHeader(const char* src, uint32_t* dawncmdlen) {
-  assert(src[0] == MSGT_DAWNCMD);
+static void decodeDawnCmdHeader(const char* src, uint32_t* dawncmdlen,
+                                uint32_t* rawlen = nullptr) {
+  assert(src[0] == MSGT_DAWNCMD || src[0] == MSGT_DAWNCMD_STREAM || src[0] == MSGT_DAWNCMD_Z);
   *dawncmdlen = ntohl(*((uint32_t*)&src[1]));
+  if (rawlen != nullptr) {
+    *rawlen = ntohl(*((uint32_t*)&src[5]));
+  }
 }
 
 static void decodeFramebufferInfo(const char* src, DawnRemoteProtocol::FramebufferInfo* fbinfo) {
@@ -100,11 +120,38 @@ static void encodeReservation(char* dst, const dawn_wire::ReservedSwapChain& scr
   *((dawn_wire::ReservedSwapChain*)&dst[1]) = scr; // FIXME
 }
 
+static void encodeSharedMemory(char* dst, uint32_t id, uint64_t size) {
+  dst[0] = MSGT_SHM;
+  *((uint32_t*)&dst[1]) = htonl(id);
+  *((uint32_t*)&dst[5]) = htonl((uint32_t)(size >> 32));
+  *((uint32_t*)&dst[9]) = htonl((uint32_t)size);
+}
+
+static void decodeSharedMemory(const char* src, uint32_t* id, uint64_t* size) {
+  assert(src[0] == MSGT_SHM);
+  *id = ntohl(*((uint32_t*)&src[1]));
+  *size = ((uint64_t)ntohl(*((uint32_t*)&src[5])) << 32) | ntohl(*((uint32_t*)&src[9]));
+}
+
 static void decodeReservation(const char* src, dawn_wire::ReservedSwapChain* scr) {
   assert(src[0] == MSGT_RESERVATION);
   *scr = *((dawn_wire::ReservedSwapChain*)&src[1]); // FIXME
 }
 
+bool DawnRemoteProtocol::sendHello() {
+  char tmp[HELLO_MSG_SIZE];
+  if (_wbuf.avail() < sizeof(tmp)) {
+    trace("not enough buffer space in _wbuf");
+    return false;
+  }
+  tmp[0] = MSGT_HELLO;
+  *((uint32_t*)&tmp[1]) = htonl(features);
+  _wbuf.write(tmp, sizeof(tmp));
+  countMsgOut(MSGT_HELLO);
+  outputAdded();
+  return true;
+}
+
 bool DawnRemoteProtocol::sendFrameSignal() {
   if (_wbuf.avail() < 1) {
     trace("not enough buffer space in _wbuf");
@@ -113,7 +160,8 @@ bool DawnRemoteProtocol::sendFrameSignal() {
   if (_wbuf.writec(MSGT_FRAME_SIGNAL) != 1) {
     return false;
   }
-  setNeedsWriteFlush();
+  countMsgOut(MSGT_FRAME_SIGNAL);
+  outputAdded();
   return true;
 }
 
@@ -125,7 +173,8 @@ bool DawnRemoteProtocol::sendFramebufferInfo(const FramebufferInfo& info) {
   }
   encodeFramebufferInfo(tmp, info);
   _wbuf.write(tmp, sizeof(tmp));
-  setNeedsWriteFlush();
+  countMsgOut(MSGT_FB_INFO);
+  outputAdded();
   return true;
 }
 
@@ -137,39 +186,216 @@ bool DawnRemoteProtocol::sendReservation(const dawn_wire::ReservedSwapChain& scr
   }
   encodeReservation(tmp, scr);
   _wbuf.write(tmp, sizeof(tmp));
-  setNeedsWriteFlush();
+  countMsgOut(MSGT_RESERVATION);
+  outputAdded();
+  return true;
+}
+
+// sendOrdered sends a message after any Dawn command data serialized so far, optionally
+// passing fd along with it. Takes ownership of fd.
+bool DawnRemoteProtocol::sendOrdered(const char* msg, size_t len, int fd) {
+  OutChunk* c = allocOutChunk(0);
+  if (c == nullptr || _rl == nullptr) {
+    if (c != nullptr) {
+      freeOutChunk(c);
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+  if (_outcur != nullptr) {
+    sealOutChunk();
+  }
+  memcpy(c->data(), msg, len);
+  c->len = (uint32_t)len;
+  c->fd = fd;
+  enqueueOutChunk(c);
+  countMsgOut(msg[0]);
+  outputAdded();
+  return true;
+}
+
+bool DawnRemoteProtocol::sendSharedMemory(uint32_t id, uint64_t size, int fd) {
+  assert(fdPassing);
+  char tmp[SHM_MSG_SIZE];
+  encodeSharedMemory(tmp, id, size);
+  return sendOrdered(tmp, sizeof(tmp), fd);
+}
+
+bool DawnRemoteProtocol::sendFrameCredits(uint32_t n) {
+  char tmp[CREDITS_MSG_SIZE];
+  if (_wbuf.avail() < sizeof(tmp)) {
+    trace("not enough buffer space in _wbuf");
+    return false;
+  }
+  tmp[0] = MSGT_FRAME_CREDITS;
+  *((uint32_t*)&tmp[1]) = htonl(n);
+  _wbuf.write(tmp, sizeof(tmp));
+  countMsgOut(MSGT_FRAME_CREDITS);
+  outputAdded();
   return true;
 }
 
+bool DawnRemoteProtocol::endFrame() {
+  if (!_inFrame) {
+    return false;
+  }
+  _inFrame = false;
+  // the frame's commands must arrive first
+  char msg = MSGT_FRAME_END;
+  if (!sendOrdered(&msg, 1, -1)) {
+    return false;
+  }
+  _frameEnds.push_back(ev_time());
+  traceEvent(TRACE_FRAME_END, traceId);
+  scheduleFrame();
+  return true;
+}
+
+void DawnRemoteProtocol::addFrameCredits(uint32_t n) {
+  traceEvent(TRACE_FRAME_CREDITS, traceId, n);
+  _frameCredits += n;
+  double now = ev_time();
+  for (; n > 0 && !_frameEnds.empty(); n--) {
+    double t = now - _frameEnds.front();
+    _frameEnds.pop_front();
+    _frameDrainTime =
+      _frameDrainTime == 0 ? t : _frameDrainTime + (t - _frameDrainTime) * FRAME_DRAIN_WEIGHT;
+  }
+  scheduleFrame();
+}
+
+static void DawnRemoteProtocol_onFrameTimer(RunLoop* rl, ev_timer* w, int revents) {
+  ((DawnRemoteProtocol*)w->data)->startFrame();
+}
+
+// scheduleFrame arranges for startFrame to be called when the next frame is due.
+// onFrame is always called from the event loop, never from within endFrame.
+void DawnRemoteProtocol::scheduleFrame() {
+  if (_rl == nullptr || _inFrame || _frameCredits == 0 || !onFrame) {
+    return;
+  }
+  double credits = _frameCredits + _frameEnds.size();
+  double interval = std::max(minFrameInterval, _frameDrainTime / credits);
+  double delay = std::max(0.0, _frameStart + interval - ev_time());
+  ev_timer_stop(_rl, &_frameTimer);
+  ev_timer_set(&_frameTimer, delay, 0.);
+  ev_timer_start(_rl, &_frameTimer);
+}
+
+void DawnRemoteProtocol::startFrame() {
+  if (_rl == nullptr || _inFrame || _frameCredits == 0 || !onFrame) {
+    return;
+  }
+  _inFrame = true;
+  _frameCredits--;
+  _frameStart = ev_time();
+  traceEvent(TRACE_FRAME_START, traceId, _frameCredits);
+  onFrame(); // user callback
+}
+
 bool DawnRemoteProtocol::maybeReadIncomingDawnCmd() {
   assert(_dawnCmdRLen > 0);
-  assert(_dawnCmdRLen <= DAWNCMD_MAX);
+  assert(_dawnCmdRLen <= _rbuf.cap());
   if (_rbuf.len() < _dawnCmdRLen) {
     return false;
   }
 
-  // onDawnBuffer expects a contiguous memory segment; attempt to simply reference
-  // the data in rbuf. takeRef returns null if the data is not available as a contiguous
-  // segement, in which case we resort to copying it into a temporary buffer.
+  // onDawnBuffer expects a contiguous memory segment. _rbuf is a MirrorPipe so
+  // the data is always available as a contiguous segment, even when it wraps around.
   const char* buf = _rbuf.takeRef(_dawnCmdRLen);
-  if (buf == nullptr) {
-    // copy into temporary buffer
-    trace("copy into temporary buffer _dawntmp");
-    _rbuf.read(_dawntmp, _dawnCmdRLen);
-    buf = _dawntmp;
-  }
-  onDawnBuffer(buf, _dawnCmdRLen);
+  assert(buf != nullptr);
+  uint32_t len = _dawnCmdRLen;
   _dawnCmdRLen = 0;
+
+  if (_dawnCmdZLen > 0) {
+    if (_zbufCap < _dawnCmdZLen) {
+      char* p = (char*)realloc(_zbuf, _dawnCmdZLen);
+      if (p == nullptr) {
+        errlog("failed to allocate %u bytes for decompression", _dawnCmdZLen);
+        stop();
+        return true;
+      }
+      _zbuf = p;
+      _zbufCap = _dawnCmdZLen;
+    }
+    ssize_t n = lzDecompress(buf, len, _zbuf, _dawnCmdZLen);
+    if (n != (ssize_t)_dawnCmdZLen) {
+      errlog("corrupt compressed dawn command buffer");
+      stop();
+      return true;
+    }
+    trace("decompressed %u -> %u bytes", len, _dawnCmdZLen);
+    buf = _zbuf;
+    len = _dawnCmdZLen;
+    _dawnCmdZLen = 0;
+    _stats.payloadCopies.add(1);
+    _stats.payloadCopyBytes.add(len);
+  }
+
+  if (capture != nullptr) {
+    capture->add(CAPTURE_DAWNCMD, buf, len);
+  }
+  onDawnBuffer(buf, len);
   return true;
 }
 
-// readMsg reads a protocol message from the read buffer (_rbuf)
+// readIncomingDawnStream moves data from _rbuf to the MSGT_DAWNCMD_STREAM payload being
+// received. Returns true when the payload is complete and has been passed to onDawnBuffer.
+bool DawnRemoteProtocol::readIncomingDawnStream() {
+  assert(_dawnStream != nullptr);
+  size_t n = std::min(_rbuf.len(), (size_t)(_dawnStreamLen - _dawnStreamOffs));
+  if (n > 0) {
+    memcpy(_dawnStream + _dawnStreamOffs, _rbuf.takeRef(n), n);
+    _dawnStreamOffs += (uint32_t)n;
+  }
+  if (_dawnStreamOffs < _dawnStreamLen) {
+    return false;
+  }
+  trace("dawn command stream of %u bytes complete", _dawnStreamLen);
+  _stats.payloadCopies.add(1);
+  _stats.payloadCopyBytes.add(_dawnStreamLen);
+  char* buf = _dawnStream;
+  _dawnStream = nullptr;
+  if (capture != nullptr) {
+    capture->add(CAPTURE_DAWNCMD, buf, _dawnStreamLen);
+  }
+  onDawnBuffer(buf, _dawnStreamLen);
+  free(buf);
+  return true;
+}
+
+// readMsg handles all complete protocol messages in the read buffer (_rbuf), leaving any
+// incomplete message in _rbuf. Returns false if the connection was closed.
 bool DawnRemoteProtocol::readMsg() {
-  char tmp[MAX(MAX(DAWNCMD_MSG_HEADER_SIZE, FB_INFO_SIZE), RESERVATION_SIZE) + 1];
-  while (_rbuf.len() > 0) {
-    switch (_rbuf.at(0)) {
+  char tmp[MAX(MAX(MAX(DAWNCMD_MSG_HEADER_SIZE, FB_INFO_SIZE), RESERVATION_SIZE),
+               MAX(MAX(SHM_MSG_SIZE, HELLO_MSG_SIZE), CREDITS_MSG_SIZE)) +
+           1];
+  while (_rl != nullptr && !updateCongestion() && !readingPaused()) {
+    if (_dawnCmdRLen > 0) {
+      if (!maybeReadIncomingDawnCmd()) {
+        break; // need more data
+      }
+      continue;
+    }
+    if (_dawnStream != nullptr) {
+      if (!readIncomingDawnStream()) {
+        break; // need more data
+      }
+      continue;
+    }
+    if (_rbuf.len() == 0) {
+      break;
+    }
+
+    char msgtype = _rbuf.at(0);
+    switch (msgtype) {
 
     case MSGT_FB_INFO: {
+      if (_rbuf.len() < FB_INFO_SIZE + 1) {
+        return true; // need more data
+      }
       trace("MSGT_FB_INFO");
       _rbuf.read(tmp, FB_INFO_SIZE + 1);
       decodeFramebufferInfo(tmp, &_fbinfo);
@@ -178,10 +404,16 @@ bool DawnRemoteProtocol::readMsg() {
     }
 
     case MSGT_RESERVATION: {
+      if (_rbuf.len() < RESERVATION_SIZE + 1) {
+        return true; // need more data
+      }
       trace("MSGT_RESERVATION");
       _rbuf.read(tmp, RESERVATION_SIZE + 1);
       dawn_wire::ReservedSwapChain scr;
       decodeReservation(tmp, &scr);
+      if (capture != nullptr) {
+        capture->add(CAPTURE_RESERVATION, &scr, sizeof(scr));
+      }
       onSwapchainReservation(scr);
       break;
     }
@@ -189,124 +421,483 @@ bool DawnRemoteProtocol::readMsg() {
     case MSGT_FRAME_SIGNAL: {
       trace("MSGT_FRAME_SIGNAL");
       _rbuf.discard(1);
-      if (_dawnout.flushlen == 0) {
-        onFrame(); // user callback
+      addFrameCredits(1);
+      break;
+    }
+
+    case MSGT_FRAME_CREDITS: {
+      if (_rbuf.len() < CREDITS_MSG_SIZE) {
+        return true; // need more data
+      }
+      _rbuf.read(tmp, CREDITS_MSG_SIZE);
+      uint32_t n = ntohl(*((uint32_t*)&tmp[1]));
+      trace("MSGT_FRAME_CREDITS %u", n);
+      addFrameCredits(n);
+      break;
+    }
+
+    case MSGT_FRAME_END: {
+      trace("MSGT_FRAME_END");
+      _rbuf.discard(1);
+      if (capture != nullptr) {
+        capture->add(CAPTURE_FRAME_END, nullptr, 0);
+      }
+      if (onFrameEnd) {
+        onFrameEnd();
       } else {
-        // a new frame started before we had a chance to finish writing the last frame
-        dlog("WARNING: new frame while still writing old frame; skipping this frame");
+        sendFrameCredits(1);
+      }
+      break;
+    }
+
+    case MSGT_HELLO: {
+      if (_rbuf.len() < HELLO_MSG_SIZE) {
+        return true; // need more data
+      }
+      _rbuf.read(tmp, HELLO_MSG_SIZE);
+      uint32_t peerFeatures = ntohl(*((uint32_t*)&tmp[1]));
+      _features = features & peerFeatures;
+      trace("MSGT_HELLO peer features=0x%x negotiated=0x%x", peerFeatures, _features);
+      break;
+    }
+
+    case MSGT_SHM: {
+      if (_rbuf.len() < SHM_MSG_SIZE) {
+        return true; // need more data
+      }
+      uint32_t id;
+      uint64_t size;
+      _rbuf.read(tmp, SHM_MSG_SIZE);
+      decodeSharedMemory(tmp, &id, &size);
+      trace("MSGT_SHM id=%u size=%llu", id, (unsigned long long)size);
+      if (_rfds.empty()) {
+        errlog("MSGT_SHM message without file descriptor");
+        stop();
+        return false;
+      }
+      int fd = _rfds.front();
+      _rfds.pop_front();
+      if (capture != nullptr) {
+        CaptureShm shm = {.id = id, .size = size};
+        capture->add(CAPTURE_SHM, &shm, sizeof(shm));
+      }
+      if (onSharedMemory) {
+        onSharedMemory(id, size, fd);
+      } else {
+        close(fd);
       }
       break;
     }
 
     case MSGT_DAWNCMD: {
-      trace("MSGT_DAWNCMD _rbuf.len() = %zu, _rbuf[0] = 0x%02X", _rbuf.len(), _rbuf.at(0));
-      if (_rbuf.len() >= DAWNCMD_MSG_HEADER_SIZE) {
-        _rbuf.read(tmp, DAWNCMD_MSG_HEADER_SIZE);
-        decodeDawnCmdHeader(tmp, &_dawnCmdRLen);
-        trace("start reading dawn command buffer of size %u", _dawnCmdRLen);
-        maybeReadIncomingDawnCmd();
+      if (_rbuf.len() < DAWNCMD_MSG_HEADER_SIZE) {
+        return true; // need more data
+      }
+      trace("MSGT_DAWNCMD _rbuf.len() = %zu", _rbuf.len());
+      _rbuf.read(tmp, DAWNCMD_MSG_HEADER_SIZE);
+      decodeDawnCmdHeader(tmp, &_dawnCmdRLen);
+      if (_dawnCmdRLen > _rbuf.cap()) {
+        errlog("dawn command buffer too large (%u bytes)", _dawnCmdRLen);
+        stop();
+        return false;
+      }
+      trace("start reading dawn command buffer of size %u", _dawnCmdRLen);
+      break;
+    }
+
+    case MSGT_DAWNCMD_Z: {
+      if (_rbuf.len() < DAWNCMD_MSG_HEADER_SIZE) {
+        return true; // need more data
       }
+      uint32_t rawlen;
+      _rbuf.read(tmp, DAWNCMD_MSG_HEADER_SIZE);
+      decodeDawnCmdHeader(tmp, &_dawnCmdRLen, &rawlen);
+      trace("MSGT_DAWNCMD_Z of size %u (%u uncompressed)", _dawnCmdRLen, rawlen);
+      if ((_features & FeatureCompression) == 0) {
+        errlog("compressed dawn command buffer without negotiated compression");
+        stop();
+        return false;
+      }
+      if (_dawnCmdRLen == 0 || _dawnCmdRLen > _rbuf.cap() || rawlen == 0 ||
+          rawlen > maxCmdSize) {
+        errlog("invalid compressed dawn command buffer (%u/%u bytes)", _dawnCmdRLen, rawlen);
+        stop();
+        return false;
+      }
+      _dawnCmdZLen = rawlen;
+      break;
+    }
+
+    case MSGT_DAWNCMD_STREAM: {
+      if (_rbuf.len() < DAWNCMD_MSG_HEADER_SIZE) {
+        return true; // need more data
+      }
+      uint32_t len;
+      _rbuf.read(tmp, DAWNCMD_MSG_HEADER_SIZE);
+      decodeDawnCmdHeader(tmp, &len);
+      trace("MSGT_DAWNCMD_STREAM of size %u", len);
+      if (len > maxCmdSize) {
+        errlog("dawn command stream too large (%u bytes)", len);
+        stop();
+        return false;
+      }
+      if (len == 0) {
+        break;
+      }
+      _dawnStream = (char*)malloc(len);
+      if (_dawnStream == nullptr) {
+        errlog("failed to allocate %u bytes for dawn command stream", len);
+        stop();
+        return false;
+      }
+      _dawnStreamLen = len;
+      _dawnStreamOffs = 0;
       break;
     }
 
     default: {
       // unexpected/corrupt message data
-      char c = _rbuf.at(0);
-      errlog("unexpected message (first byte: '%c' 0x%02x, rbuf.len(): %zu)", c, c, _rbuf.len());
+      errlog("unexpected message (first byte: '%c' 0x%02x, rbuf.len(): %zu)", msgtype, msgtype,
+             _rbuf.len());
       trace("closing connection");
       stop();
       return false;
     }
     } // switch
-  }   // while
+    _stats.msgsIn[msgtype & 0x7f].add(1);
+    traceEvent(TRACE_MSG_IN, traceId, (uint8_t)msgtype);
+  } // while
 
-  return true;
+  return _rl != nullptr;
 }
 
-static void DawnRemoteProtocol_doIO(RunLoop* rl, ev_io* w, int revents) {
-  DawnRemoteProtocol* p = (DawnRemoteProtocol*)w->data;
-  p->doIO(revents);
+// readFromSocket reads <=nbyte from _io.fd into _rbuf, collecting any file descriptors
+// passed along with the data into _rfds when fdPassing is enabled.
+ssize_t DawnRemoteProtocol::readFromSocket(size_t nbyte) {
+  if (!fdPassing) {
+    return _rbuf.readFromFD(_io.fd, nbyte);
+  }
+  struct iovec iov[2];
+  int iovcnt = _rbuf.spaceIOVecs(iov, nbyte);
+  if (iovcnt == 0) {
+    return 0;
+  }
+  char cmsgbuf[CMSG_SPACE(sizeof(int) * RECV_FDS_MAX)];
+  struct msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  msg.msg_control = cmsgbuf;
+  msg.msg_controllen = sizeof(cmsgbuf);
+  int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+  flags |= MSG_CMSG_CLOEXEC;
+#endif
+  ssize_t n = recvmsg(_io.fd, &msg, flags);
+  if (n < 0) {
+    return n;
+  }
+  _rbuf.commit((size_t)n);
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      size_t nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t i = 0; i < nfds; i++) {
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+        _rfds.push_back(fd);
+      }
+    }
+  }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    errlog("file descriptors were dropped (MSG_CTRUNC)");
+  }
+  return n;
 }
 
-void DawnRemoteProtocol::doIO(int revents) {
-  dlog("DawnRemoteProtocol::doIO %s %s", revents & EV_READ ? "EV_READ" : "",
-       revents & EV_WRITE ? "EV_WRITE" : "");
+// readIn reads from _io.fd into _rbuf and handles incoming messages, until reading would
+// block or until readBudget bytes have been read or readTimeBudget seconds have passed,
+// whichever comes first. In the latter cases the rest is read on the next EV_READ, giving
+// other watchers a chance to run.
+void DawnRemoteProtocol::readIn() {
+  size_t total = 0;
+  ev_tstamp deadline = readTimeBudget > 0 ? ev_time() + readTimeBudget : 0;
+  uint64_t traceStart = traceBegin();
 
-  if (revents & EV_READ) {
-    // read into _rbuf
-    ssize_t n = _rbuf.readFromFD(_io.fd, _rbuf.cap()) > 0;
+  // batch up any output produced while handling incoming messages
+  cork();
+  while (_rl != nullptr && !readingPaused()) {
+    size_t nbyte = _rbuf.avail();
+    ssize_t n = readFromSocket(nbyte);
     if (n <= 0) {
       if (n < 0) {
         if (errno == EAGAIN) {
-          return;
+          break;
+        }
+        if (errno == EINTR) {
+          continue;
         }
         perror("read");
+      } else if (nbyte == 0) {
+        errlog("read buffer full (message too large?)");
+      } else {
+        trace("EOF");
       }
-      trace("EOF");
       stop();
-      return;
+      break;
     }
     trace("read %zd bytes into _rbuf; _rbuf.len() = %zu", n, _rbuf.len());
-    if (_dawnCmdRLen > 0) {
-      trace("maybeReadIncomingDawnCmd");
-      maybeReadIncomingDawnCmd();
-    } else {
-      if (!readMsg()) {
-        return;
-      }
+    total += (size_t)n;
+    _stats.bytesIn.add((uint64_t)n);
+
+    if (!readMsg()) {
+      break;
     }
+
+    // A short read means that the socket has been drained
+    if ((size_t)n < nbyte || total >= readBudget || (deadline > 0 && ev_time() >= deadline)) {
+      break;
+    }
+  }
+  uncork();
+  traceSpan(TRACE_READ, traceId, traceStart, metricsNow(), total);
+}
+
+static void DawnRemoteProtocol_doIO(RunLoop* rl, ev_io* w, int revents) {
+  DawnRemoteProtocol* p = (DawnRemoteProtocol*)w->data;
+  p->doIO(revents);
+}
+
+void DawnRemoteProtocol::doIO(int revents) {
+  dlog("DawnRemoteProtocol::doIO %s %s", revents & EV_READ ? "EV_READ" : "",
+       revents & EV_WRITE ? "EV_WRITE" : "");
+
+  if (revents & EV_READ) {
+    readIn();
   }
 
   if (revents & EV_WRITE) {
+    flushOutput();
+  }
+}
 
-    // if we are flushing Dawn command data, do that before draining _wbuf
-    if (_dawnout.flushlen != 0) {
-      assert(_dawnout.flushlen > _dawnout.flushoffs);
-      uint32_t len = _dawnout.flushlen - _dawnout.flushoffs;
-      trace("_dawnout flush [offs=%u, len=%u]", _dawnout.flushoffs, len);
-      ssize_t n = ::write(_io.fd, &_dawnout.flushbuf[_dawnout.flushoffs], len);
-      if (n < 1) {
-        if (n < 0 && errno != EAGAIN) {
-          perror("write");
-        }
-        return;
-      }
-      _dawnout.flushoffs += (uint32_t)n;
-      if (_dawnout.flushlen == _dawnout.flushoffs) {
-        trace("_dawnout flush done");
-        _dawnout.flushlen = 0;
-      } else {
-        // we weren't able to write all of _dawnout.flushbuf; return and wait for more EV_WRITE
-        trace("_dawnout flush more");
-        assert(_dawnout.flushoffs < _dawnout.flushlen);
-        return;
-      }
+// writeOut writes as much as possible of pending Dawn command data (_outq) and
+// control messages (_wbuf) to _io.fd, using a single writev call.
+// Returns the number of bytes written, 0 if there was nothing to write or -1 on error.
+ssize_t DawnRemoteProtocol::writeOut() {
+  // Output order is _outq followed by _wbuf, except when a previous call only wrote
+  // part of _wbuf, in which case the rest of those messages (_wbufHead) must go first.
+  // Chunks with a file descriptor attached are sent on their own, with sendmsg.
+  if (_wbufHead == 0 && _outqHead != nullptr && _outqHead->fd > -1) {
+    return sendOutChunkFD();
+  }
+  struct iovec iov[2 + DAWNCMD_OUTQ_IOV_MAX + 2];
+  int iovcnt = 0;
+  size_t wbufHeadLen = _wbufHead;
+  size_t dawnLen = 0;
+  size_t wbufTailLen = 0;
+  if (wbufHeadLen > 0) {
+    iovcnt += _wbuf.dataIOVecs(&iov[iovcnt], wbufHeadLen);
+  }
+  int nchunks = 0;
+  for (OutChunk* c = _outqHead; c != nullptr && nchunks < DAWNCMD_OUTQ_IOV_MAX; c = c->next) {
+    assert(c->len > c->offs);
+    if (c->fd > -1) {
+      break; // next call sends c
     }
+    iov[iovcnt].iov_base = c->data() + c->offs;
+    iov[iovcnt++].iov_len = c->len - c->offs;
+    dawnLen += c->len - c->offs;
+    nchunks++;
+  }
+  // only append _wbuf if all of _outq fits in this writev
+  if (wbufHeadLen == 0 && dawnLen == _outqLen) {
+    wbufTailLen = _wbuf.len();
+    iovcnt += _wbuf.dataIOVecs(&iov[iovcnt], wbufTailLen);
+  }
+  if (iovcnt == 0) {
+    return 0;
+  }
 
-    // drain _wbuf
-    size_t nbyte = _wbuf.len();
-    if (nbyte > 0) {
-      ssize_t z = _wbuf.writeToFD(_io.fd, nbyte);
-      if (z < 0 && errno != EAGAIN) {
-        perror("write");
-        stop();
-        return;
+  ssize_t n = ::writev(_io.fd, iov, iovcnt);
+  if (n < 0) {
+    return n;
+  }
+  trace("writev %zd bytes (wbuf head %zu, outq %zu, wbuf %zu)", n, wbufHeadLen, dawnLen,
+        wbufTailLen);
+  _stats.bytesOut.add((uint64_t)n);
+  traceEvent(TRACE_WRITE, traceId, (uint64_t)n);
+
+  size_t z = (size_t)n;
+  size_t k = std::min(z, wbufHeadLen);
+  _wbuf.discard(k);
+  _wbufHead -= k;
+  z -= k;
+
+  k = std::min(z, dawnLen);
+  _outqLen -= k;
+  z -= k;
+  while (k > 0) {
+    OutChunk* c = _outqHead;
+    uint32_t chunklen = (uint32_t)std::min(k, (size_t)(c->len - c->offs));
+    c->offs += chunklen;
+    k -= chunklen;
+    if (c->offs == c->len) {
+      _outqHead = c->next;
+      if (_outqHead == nullptr) {
+        _outqTail = nullptr;
+        _stats.flushDrain.record(metricsNow() - _drainStart);
       }
+      freeOutChunk(c);
     }
+  }
+
+  _wbuf.discard(z);
+  if (z > 0 && z < wbufTailLen) {
+    _wbufHead = wbufTailLen - z;
+  }
+  return n;
+}
+
+// sendOutChunkFD writes the chunk at the head of _outq along with its file descriptor
+ssize_t DawnRemoteProtocol::sendOutChunkFD() {
+  OutChunk* c = _outqHead;
+  assert(c->fd > -1 && c->offs == 0);
+  struct iovec iov = {.iov_base = c->data(), .iov_len = c->len};
+  char cmsgbuf[CMSG_SPACE(sizeof(int))];
+  memset(cmsgbuf, 0, sizeof(cmsgbuf));
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgbuf;
+  msg.msg_controllen = sizeof(cmsgbuf);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &c->fd, sizeof(int));
 
-    // stop requesting EV_WRITE if there's nothing waiting to be written
-    if (_wbuf.len() == 0) {
-      ev_io_stop(_rl, &_io);
-      ev_io_modify(&_io, _io.events & ~EV_WRITE);
-      ev_io_start(_rl, &_io);
+  ssize_t n = sendmsg(_io.fd, &msg, 0);
+  if (n < 0) {
+    return n;
+  }
+  trace("sendmsg %zd bytes with fd %d", n, c->fd);
+  _stats.bytesOut.add((uint64_t)n);
+  traceEvent(TRACE_WRITE, traceId, (uint64_t)n);
+  // the file descriptor has been passed along with the first byte
+  close(c->fd);
+  c->fd = -1;
+  c->offs += (uint32_t)n;
+  _outqLen -= (size_t)n;
+  if (c->offs == c->len) {
+    _outqHead = c->next;
+    if (_outqHead == nullptr) {
+      _outqTail = nullptr;
+      _stats.flushDrain.record(metricsNow() - _drainStart);
     }
+    freeOutChunk(c);
+  }
+  return n;
+}
+
+// flushOutput writes pending output and requests EV_WRITE only if some is left over
+void DawnRemoteProtocol::flushOutput() {
+  if (_rl == nullptr) {
+    return;
+  }
+  if (writeOut() < 0 && errno != EAGAIN) {
+    perror("write");
+    stop();
+    return;
+  }
+  if (hasPendingOutput()) {
+    setNeedsWriteFlush();
+  } else if (_io.events & EV_WRITE) {
+    // stop requesting EV_WRITE since there's nothing waiting to be written
+    ev_io_stop(_rl, &_io);
+    ev_io_modify(&_io, _io.events & ~EV_WRITE);
+    ev_io_start(_rl, &_io);
+  }
+  updateCongestion();
+}
+
+// outputAdded is called when new output has been queued. Unless output is corked, it is
+// written right away (write-through) and EV_WRITE is only used for whatever the socket
+// can't take without blocking.
+void DawnRemoteProtocol::outputAdded() {
+  if (_corked == 0) {
+    flushOutput();
+  }
+}
+
+void DawnRemoteProtocol::pauseReading() {
+  trace("pause reading");
+  _readPaused = true;
+  updateReading();
+}
+
+void DawnRemoteProtocol::resumeReading() {
+  trace("resume reading");
+  _readPaused = false;
+  updateReading();
+}
+
+// updateReading starts or stops EV_READ after _readPaused or _congested changed
+void DawnRemoteProtocol::updateReading() {
+  if (_rl == nullptr || readingPaused() == ((_io.events & EV_READ) == 0)) {
+    return;
+  }
+  ev_io_stop(_rl, &_io);
+  ev_io_modify(&_io, readingPaused() ? _io.events & ~EV_READ : _io.events | EV_READ);
+  ev_io_start(_rl, &_io);
+  if (!readingPaused()) {
+    // handle messages that were read before reading was paused
+    cork();
+    readMsg();
+    uncork();
   }
 }
 
-void DawnRemoteProtocol::start(RunLoop* rl, int fd) {
+// updateCongestion marks the connection congested once _outq has grown to _outqMax, and
+// no longer congested once the peer has read enough for at most half that to be left.
+// Returns _congested.
+bool DawnRemoteProtocol::updateCongestion() {
+  if (!_congested && _outqLen >= _outqMax) {
+    trace("output queue full (%zu bytes); congested until the peer catches up", _outqLen);
+    _congested = true;
+    _congestStart = traceBegin();
+    updateReading();
+  } else if (_congested && _outqLen <= _outqMax / 2) {
+    trace("output queue drained (%zu bytes); no longer congested", _outqLen);
+    traceSpan(TRACE_BACKPRESSURE, traceId, _congestStart, metricsNow());
+    _congested = false;
+    updateReading();
+  }
+  return _congested;
+}
+
+void DawnRemoteProtocol::cork() {
+  _corked++;
+}
+
+void DawnRemoteProtocol::uncork() {
+  assert(_corked > 0);
+  if (--_corked == 0 && hasPendingOutput()) {
+    flushOutput();
+  }
+}
+
+bool DawnRemoteProtocol::start(RunLoop* rl, int fd) {
   trace("START");
+  size_t rbufSize = chunkSize + DAWNCMD_MSG_HEADER_SIZE;
+  if ((!_rbuf.initialized() || _rbuf.cap() < rbufSize) && !_rbuf.init(rbufSize)) {
+    return false;
+  }
   _rbuf.clear();
   _wbuf.clear();
+  _wbufHead = 0;
+  _corked = 0;
+  _readPaused = false;
+  _congested = false;
 #ifdef DEBUG
   _rbuf._debugname = "rbuf";
   _wbuf._debugname = "wbuf";
@@ -316,18 +907,85 @@ void DawnRemoteProtocol::start(RunLoop* rl, int fd) {
   _io.data = (void*)this;
   ev_io_init(&_io, DawnRemoteProtocol_doIO, fd, EV_READ);
   ev_io_start(rl, &_io);
+
+  _frameCredits = 0;
+  _inFrame = false;
+  _frameEnds.clear();
+  _frameDrainTime = 0;
+  _frameStart = 0;
+  _frameTimer.data = (void*)this;
+  ev_timer_init(&_frameTimer, DawnRemoteProtocol_onFrameTimer, 0., 0.);
+
+  _features = 0;
+  if (features != 0 && !sendHello()) {
+    stop();
+    return false;
+  }
+  return true;
 }
 
 void DawnRemoteProtocol::stop() {
   trace("STOP");
-  // reset _dawnout
-  _dawnout.writelen = DAWNCMD_MSG_HEADER_SIZE;
-  _dawnout.flushlen = 0;
+  // discard any pending output
+  if (_outcur != nullptr) {
+    freeOutChunk(_outcur);
+    _outcur = nullptr;
+  }
+  while (_outqHead != nullptr) {
+    OutChunk* c = _outqHead;
+    _outqHead = c->next;
+    freeOutChunk(c);
+  }
+  _outqTail = nullptr;
+  _outqLen = 0;
+  _congested = false;
+  _wbufHead = 0;
+  // discard any partially received input
+  _dawnCmdRLen = 0;
+  _dawnCmdZLen = 0;
+  for (int fd : _rfds) {
+    close(fd);
+  }
+  _rfds.clear();
+  free(_dawnStream);
+  _dawnStream = nullptr;
   // unsubscribe from IO events
   if (_rl != nullptr) {
     ev_io_stop(_rl, &_io);
+    ev_timer_stop(_rl, &_frameTimer);
     _rl = nullptr;
+    if (onClose) {
+      onClose();
+    }
+  }
+}
+
+size_t DawnRemoteProtocol::memoryUsage() const {
+  size_t n = sizeof(*this) + _rbuf.cap() + _zbufCap;
+  if (_dawnStream != nullptr) {
+    n += _dawnStreamLen; // _dawnStreamLen is left as is after a stream completes
+  }
+  if (_outcur != nullptr) {
+    n += sizeof(OutChunk) + _outcur->cap;
+  }
+  for (const OutChunk* c = _outqHead; c != nullptr; c = c->next) {
+    n += sizeof(OutChunk) + c->cap;
   }
+  for (const OutChunk* c = _outfree; c != nullptr; c = c->next) {
+    n += sizeof(OutChunk) + c->cap;
+  }
+  return n;
+}
+
+DawnRemoteProtocol::~DawnRemoteProtocol() {
+  onClose = nullptr;
+  stop();
+  while (_outfree != nullptr) {
+    OutChunk* c = _outfree;
+    _outfree = c->next;
+    free(c);
+  }
+  free(_zbuf);
 }
 
 void DawnRemoteProtocol::setNeedsWriteFlush2() {
@@ -338,58 +996,158 @@ void DawnRemoteProtocol::setNeedsWriteFlush2() {
   }
 }
 
-void* DawnRemoteProtocol::GetCmdSpace(size_t size) {
-  trace("GetCmdSpace %zu", size);
-  assert(size <= DAWNCMD_MAX);
-  if (sizeof(_dawnout.writebuf) - size < _dawnout.writelen) {
-    dlog("GetCmdSpace FAILED (not enough space)");
-    return nullptr; // not enough space
+// allocOutChunk returns a chunk with room for a message with a payload of payloadSize bytes.
+// Chunks of the standard size (chunkSize) are taken from the pool when available.
+DawnRemoteProtocol::OutChunk* DawnRemoteProtocol::allocOutChunk(size_t payloadSize) {
+  uint32_t cap = (uint32_t)(std::max(payloadSize, chunkSize) + DAWNCMD_MSG_HEADER_SIZE);
+  OutChunk* c = nullptr;
+  while (_outfree != nullptr && c == nullptr) {
+    c = _outfree;
+    _outfree = c->next;
+    _outfreeLen--;
+    if (c->cap != cap) {
+      free(c); // chunkSize has changed since c was allocated
+      c = nullptr;
+    }
   }
-  char* result = &_dawnout.writebuf[_dawnout.writelen];
-  _dawnout.writelen += size;
-  return result;
+  if (c == nullptr) {
+    void* p = malloc(sizeof(OutChunk) + cap);
+    if (p == nullptr) {
+      return nullptr;
+    }
+    c = new (p) OutChunk();
+    c->cap = cap;
+  }
+  c->next = nullptr;
+  c->len = DAWNCMD_MSG_HEADER_SIZE; // header is written by sealOutChunk
+  c->offs = 0;
+  c->fd = -1;
+  return c;
 }
 
-size_t DawnRemoteProtocol::GetMaximumAllocationSize() const {
-  trace("GetMaximumAllocationSize()");
-  return DAWNCMD_MAX;
+void DawnRemoteProtocol::freeOutChunk(OutChunk* c) {
+  if (c->fd > -1) {
+    close(c->fd);
+    c->fd = -1;
+  }
+  if (_outfreeLen < DAWNCMD_OUTPOOL_MAX && c->cap == chunkSize + DAWNCMD_MSG_HEADER_SIZE) {
+    c->next = _outfree;
+    _outfree = c;
+    _outfreeLen++;
+  } else {
+    free(c);
+  }
 }
 
-bool DawnRemoteProtocol::Flush() {
-  trace("Flush dawn command data %u", _dawnout.writelen);
-  assert(_dawnout.flushlen == 0 /* is done flushing previous buffer */);
-  if (_dawnout.writelen > DAWNCMD_MSG_HEADER_SIZE) {
-    // write header (preallocated at writebuf[0..DAWNCMD_MSG_HEADER_SIZE])
-    encodeDawnCmdHeader(_dawnout.writebuf, _dawnout.writelen - DAWNCMD_MSG_HEADER_SIZE);
+// sealOutChunk finalizes _outcur and adds it to the end of _outq
+void DawnRemoteProtocol::sealOutChunk() {
+  OutChunk* c = _outcur;
+  assert(c != nullptr);
+  assert(c->len > DAWNCMD_MSG_HEADER_SIZE);
+  _outcur = nullptr;
+
+  // write header (preallocated at data[0..DAWNCMD_MSG_HEADER_SIZE])
+  uint32_t payloadSize = c->len - DAWNCMD_MSG_HEADER_SIZE;
+  if (payloadSize > chunkSize) {
+    encodeDawnCmdHeader(c->data(), MSGT_DAWNCMD_STREAM, payloadSize);
+  } else if (!compressOutChunk(&c)) {
+    encodeDawnCmdHeader(c->data(), MSGT_DAWNCMD, payloadSize);
+  }
 
 #ifdef DEBUG_TRACE_PROTOCOL
-    { // log buffer
-      char* buf = (char*)malloc(_dawnout.writelen * 5);
-      ssize_t n = debugFmtBytes(buf, _dawnout.writelen * 5, _dawnout.writebuf, _dawnout.writelen);
-      if (n != -1) {
-        trace("data to be sent out: %u\n\"%s\"", _dawnout.writelen, buf);
-      }
-      free(buf);
+  { // log buffer
+    char* buf = (char*)malloc(c->len * 5);
+    ssize_t n = debugFmtBytes(buf, c->len * 5, c->data(), c->len);
+    if (n != -1) {
+      trace("data to be sent out: %u\n\"%s\"", c->len, buf);
     }
+    free(buf);
+  }
 #endif /* DEBUG_TRACE_PROTOCOL */
 
-    // swap buffers
-    char* buf1 = _dawnout.flushbuf;
-    _dawnout.flushbuf = _dawnout.writebuf;
-    _dawnout.writebuf = buf1;
-
-    // setup flush state
-    _dawnout.flushlen = _dawnout.writelen;
-    _dawnout.flushoffs = 0;
-    setNeedsWriteFlush();
+  countMsgOut(c->data()[0]);
+  traceEvent(TRACE_FLUSH, traceId, c->len);
+  enqueueOutChunk(c);
+}
 
-    // reset write
-    _dawnout.writelen = DAWNCMD_MSG_HEADER_SIZE;
+// compressOutChunk replaces *cp with a MSGT_DAWNCMD_Z chunk of its payload when compression
+// has been negotiated and makes the payload smaller. Returns false if *cp was left as is.
+bool DawnRemoteProtocol::compressOutChunk(OutChunk** cp) {
+  OutChunk* c = *cp;
+  uint32_t payloadSize = c->len - DAWNCMD_MSG_HEADER_SIZE;
+  if ((_features & FeatureCompression) == 0 || payloadSize < compressMinSize) {
+    return false;
+  }
+  OutChunk* z = allocOutChunk(0);
+  if (z == nullptr) {
+    return false;
+  }
+  size_t n = lzCompress(c->data() + DAWNCMD_MSG_HEADER_SIZE, payloadSize,
+                        z->data() + DAWNCMD_MSG_HEADER_SIZE, payloadSize - 1);
+  if (n == 0) {
+    freeOutChunk(z); // incompressible
+    return false;
+  }
+  trace("compressed %u -> %zu bytes", payloadSize, n);
+  encodeDawnCmdHeader(z->data(), MSGT_DAWNCMD_Z, (uint32_t)n, payloadSize);
+  z->len = DAWNCMD_MSG_HEADER_SIZE + (uint32_t)n;
+  freeOutChunk(c);
+  *cp = z;
+  return true;
+}
 
-    ev_run(_rl, EVRUN_NOWAIT);
+// enqueueOutChunk adds c to the end of _outq
+void DawnRemoteProtocol::enqueueOutChunk(OutChunk* c) {
+  if (_outqTail != nullptr) {
+    _outqTail->next = c;
   } else {
-    assert(_dawnout.writelen == DAWNCMD_MSG_HEADER_SIZE);
+    _outqHead = c;
+    _drainStart = metricsNow();
   }
+  _outqTail = c;
+  _outqLen += c->len;
+}
 
+void* DawnRemoteProtocol::GetCmdSpace(size_t size) {
+  trace("GetCmdSpace %zu", size);
+  if (size > maxCmdSize) {
+    dlog("GetCmdSpace FAILED (size %zu > maxCmdSize)", size);
+    return nullptr;
+  }
+  if (_outcur != nullptr && _outcur->cap - _outcur->len < size) {
+    // Not enough space in the current chunk. Queue it up for writing and start a new one.
+    // Like an explicit Flush, this puts the next command at the start of a message,
+    // which is what dawn_wire expects for commands that are split into chunks.
+    sealOutChunk();
+    outputAdded();
+  }
+  if (_outcur == nullptr) {
+    // Commands larger than chunkSize get a chunk of their own, sent as MSGT_DAWNCMD_STREAM
+    _outcur = allocOutChunk(size);
+    if (_outcur == nullptr) {
+      dlog("GetCmdSpace FAILED (out of memory)");
+      return nullptr;
+    }
+  }
+  char* result = _outcur->data() + _outcur->len;
+  _outcur->len += size;
+  return result;
+}
+
+size_t DawnRemoteProtocol::GetMaximumAllocationSize() const {
+  trace("GetMaximumAllocationSize()");
+  return maxCmdSize;
+}
+
+bool DawnRemoteProtocol::Flush() {
+  if (_outcur == nullptr) {
+    return true; // nothing to flush
+  }
+  trace("Flush dawn command data %u", _outcur->len);
+  sealOutChunk();
+  outputAdded();
+  if (flushMode == FlushMode::RunLoop && _corked == 0 && _rl != nullptr) {
+    ev_run(_rl, EVRUN_NOWAIT);
+  }
   return true;
 }
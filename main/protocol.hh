@@ -1,6 +1,7 @@
 #pragma once
 #include <algorithm>
 #include <assert.h>
+#include <deque>
 #include <functional>
 #include <limits>
 #include <unistd.h>
@@ -9,21 +10,32 @@
 #include <dawn/wire/Wire.h>
 #include <dawn/wire/WireClient.h>
 
-// DEBUG_TRACE_PROTOCOL: define to trace protocol I/O
-#define DEBUG_TRACE_PROTOCOL
+// DEBUG_TRACE_PROTOCOL: define to log protocol I/O, including hex dumps of all data, to
+// stderr. For timing, use the trace ring instead (see tracering.hh).
+// #define DEBUG_TRACE_PROTOCOL
 #if defined(DEBUG_TRACE_PROTOCOL) && !defined(DEBUG_TRACE_PIPE)
 #define DEBUG_TRACE_PIPE
 #endif
+#include "capture.hh"
+#include "metrics.hh"
+#include "mirrorpipe.hh"
 #include "pipe.hh"
+#include "tracering.hh"
 
 #include <ev.h>
 
 typedef struct ev_loop RunLoop;
 
-// dawn buffer sizes
+// dawn buffer sizes (defaults for DawnRemoteProtocol::chunkSize and maxCmdSize)
 #define DAWNCMD_MSG_HEADER_SIZE 9 /* "D" <HEXBYTE>{8} */
 #define DAWNCMD_MAX (4096 * 32)
 #define DAWNCMD_BUFSIZE (DAWNCMD_MAX + DAWNCMD_MSG_HEADER_SIZE)
+#define DAWNCMD_STREAM_MAX (256 * 1024 * 1024)
+
+// dawn output queue limits
+#define DAWNCMD_OUTQ_MAX (DAWNCMD_BUFSIZE * 16) /* nbytes queued before congestion */
+#define DAWNCMD_OUTPOOL_MAX 4                    /* number of unused chunks kept around */
+#define DAWNCMD_OUTQ_IOV_MAX 16                  /* max number of chunks written per writev */
 
 struct DawnRemoteProtocol : public dawn::wire::CommandSerializer {
   struct FramebufferInfo {
@@ -33,26 +45,124 @@ struct DawnRemoteProtocol : public dawn::wire::CommandSerializer {
     uint16_t dpscale;       // 1dp = Npx (10x percent; 0% = 0, 100% = 1000, 250% = 2500 ...)
   };
 
-  Pipe<DAWNCMD_BUFSIZE + 8> _rbuf; // incoming data (extra space for pipe impl)
-  Pipe<4096> _wbuf;                // outgoing data (in addition to _dawnout)
+  // Stats are updated on the connection's thread and may be read from any thread
+  struct Stats {
+    Counter bytesIn;
+    Counter bytesOut;
+    Counter msgsIn[128];  // by message type
+    Counter msgsOut[128]; // by message type
+    Counter payloadCopies;    // Dawn command payloads copied out of the read buffer
+    Counter payloadCopyBytes; // (streamed or decompressed payloads)
+    Histogram flushDrain;     // ns from output being queued to the output queue being empty
+  };
+
+  // OutChunk holds an outgoing message; usually a MSGT_DAWNCMD message of Dawn command data
+  struct OutChunk {
+    OutChunk* next = nullptr;
+    uint32_t cap = 0;  // capacity of data()
+    uint32_t len = 0;  // nbytes used of data(), including message header
+    uint32_t offs = 0; // nbytes of data() written to _io.fd so far
+    int fd = -1;       // file descriptor to pass along with the message (SCM_RIGHTS)
+    char* data() {
+      return (char*)(this + 1);
+    }
+  };
+
+  MirrorPipe _rbuf; // incoming data (mirrored so that dawn command buffers are contiguous)
+  Pipe<4096> _wbuf; // outgoing data (in addition to _outq)
 
-  RunLoop* _rl;
+  RunLoop* _rl = nullptr;
   ev_io _io;
   uint32_t _dawnCmdRLen = 0; // reamining nbytes to read as dawn command buffer
+  uint32_t _dawnCmdZLen = 0; // decompressed size of the dawn command buffer (0 = uncompressed)
+  std::deque<int> _rfds;     // file descriptors received, not yet claimed by a message
+
+  // incoming MSGT_DAWNCMD_STREAM payload
+  char* _dawnStream = nullptr;
+  uint32_t _dawnStreamLen = 0;  // total size of payload
+  uint32_t _dawnStreamOffs = 0; // nbytes of payload received so far
+
+  // decompressed MSGT_DAWNCMD_Z payloads
+  char* _zbuf = nullptr;
+  size_t _zbufCap = 0;
+
+  // frame pacing (client)
+  uint32_t _frameCredits = 0;    // credits available
+  bool _inFrame = false;         // between onFrame and endFrame
+  std::deque<double> _frameEnds; // endFrame times of frames in flight
+  double _frameDrainTime = 0;    // moving average of endFrame to credit return, in seconds
+  double _frameStart = 0;        // time the last frame started
+  ev_timer _frameTimer;          // calls startFrame
+  void addFrameCredits(uint32_t n);
+  void scheduleFrame();
+  void startFrame();
+  bool sendOrdered(const char* msg, size_t len, int fd);
+
+  Stats _stats;
+  uint64_t _drainStart = 0; // metricsNow() when _outq last went from empty to non-empty
+  void countMsgOut(char msgtype) {
+    _stats.msgsOut[msgtype & 0x7f].add(1);
+  }
 
-  // _dawnout is the dawn command buffer for outgoing Dawn command data
-  struct {
-    char bufs[2][DAWNCMD_BUFSIZE];
-    char* writebuf = bufs[0];                    // buffer used for GetCmdSpace
-    uint32_t writelen = DAWNCMD_MSG_HEADER_SIZE; // length of writebuf
-    char* flushbuf = bufs[1];                    // buffer being written to _io.fd
-    uint32_t flushlen = 0;                       // length of flushbuf (>0 when flushing)
-    uint32_t flushoffs = 0;                      // start offset of flushbuf
-  } _dawnout;
+  uint32_t _corked = 0;       // >0 while output is being batched up (see cork())
+  bool _readPaused = false;   // see pauseReading()
+  bool _congested = false;    // see congested()
+  uint64_t _congestStart = 0; // traceBegin() when _congested was last set
+  size_t _wbufHead = 0;       // nbytes at front of _wbuf which must be written before _outq
 
-  // _dawntmp is used for temporary storage of incoming dawn command buffers
-  // in the case that they span across Pipe boundaries.
-  char _dawntmp[DAWNCMD_MAX];
+  // Outgoing Dawn command data is serialized into _outcur by GetCmdSpace.
+  // Flush, or running out of space in _outcur, moves it to the end of _outq; a FIFO of
+  // chunks waiting to be written to _io.fd. Written chunks are recycled via _outfree.
+  // _outqMax is a soft limit: _outq may grow past it, but the connection is congested
+  // from then on until the peer has read enough of it (backpressure, see congested().)
+  OutChunk* _outcur = nullptr;
+  OutChunk* _outqHead = nullptr;
+  OutChunk* _outqTail = nullptr;
+  size_t _outqLen = 0; // nbytes waiting to be written in _outq
+  size_t _outqMax = DAWNCMD_OUTQ_MAX;
+  OutChunk* _outfree = nullptr;
+  uint32_t _outfreeLen = 0;
+
+  // FlushMode controls what Flush does after writing as much as the socket accepts
+  // without blocking. Any output left over is written when the socket becomes writable.
+  enum class FlushMode {
+    WriteThrough, // return right away; never re-enters the event loop
+    RunLoop,      // also run one non-blocking iteration of the event loop (EVRUN_NOWAIT)
+  };
+  FlushMode flushMode = FlushMode::WriteThrough;
+
+  // chunkSize is the payload size of pooled output chunks, the largest payload sent as a
+  // MSGT_DAWNCMD message and the size of the read buffer. Commands larger than this are
+  // sent as MSGT_DAWNCMD_STREAM messages, up to maxCmdSize bytes. Both peers must use the
+  // same chunkSize. Set before calling start; maxCmdSize must be set before the
+  // dawn_wire client or server is created, as it is returned by GetMaximumAllocationSize.
+  size_t chunkSize = DAWNCMD_MAX;
+  size_t maxCmdSize = DAWNCMD_STREAM_MAX;
+
+  // fdPassing enables sending and receiving file descriptors along with messages
+  // (SCM_RIGHTS), which is required for sendSharedMemory. Only for UNIX domain sockets.
+  bool fdPassing = false;
+
+  // Optional protocol features are negotiated with the peer when the connection starts;
+  // each end sends the features it supports and a feature is used only if both do.
+  // Set features before calling start.
+  enum Feature : uint32_t {
+    FeatureCompression = 1 << 0, // LZ compression of MSGT_DAWNCMD payloads
+  };
+  uint32_t features = 0;
+  uint32_t _features = 0;       // negotiated features (0 until the peer's hello arrives)
+  size_t compressMinSize = 512; // smaller payloads are sent uncompressed
+
+  // traceId identifies the connection in trace events (see tracering.hh)
+  uint32_t traceId = 0;
+
+  // capture, when set, records incoming Dawn command data, frame ends, swapchain
+  // reservations and shared memory announcements (see capture.hh)
+  CaptureWriter* capture = nullptr;
+
+  // Limits on how much input is read and handled per EV_READ event
+  size_t readBudget = DAWNCMD_BUFSIZE * 8; // nbytes
+  double readTimeBudget = 0.005;           // seconds (0 = no limit)
 
   // framebuffer info (only used by client)
   FramebufferInfo _fbinfo;
@@ -60,8 +170,18 @@ struct DawnRemoteProtocol : public dawn::wire::CommandSerializer {
   // callbacks, client and server
   std::function<void(const char* data, size_t len)> onDawnBuffer;
 
+  // onSharedMemory is called when the peer has shared a memory object of size bytes with us
+  // (see sendSharedMemory.) The callee takes ownership of fd.
+  std::function<void(uint32_t id, uint64_t size, int fd)> onSharedMemory;
+
+  // onClose is called when the connection stops, either because stop was called or
+  // because of EOF or an error. It must not destroy the protocol object.
+  std::function<void()> onClose;
+
   // callbacks, client only
-  std::function<void()> onFrame; // server is ready for a new frame
+  // onFrame is called when the client may produce a frame (see frame pacing below.)
+  // The client serializes the frame's commands and then calls endFrame.
+  std::function<void()> onFrame;
 
   // onFramebufferInfo is called whenever the underlying framebuffer changes.
   // The argument provided is the same as returned by the fbinfo() method.
@@ -71,20 +191,88 @@ struct DawnRemoteProtocol : public dawn::wire::CommandSerializer {
   // onSwapchainReservation is called when the client has made a swapchain reservation.
   std::function<void(const dawn_wire::ReservedSwapChain&)> onSwapchainReservation;
 
+  // onFrameEnd is called when all Dawn commands of a client frame have been passed to
+  // onDawnBuffer. The server returns the frame's credit with sendFrameCredits(1) once it is
+  // done with the frame. When not set, the credit is returned right away.
+  std::function<void()> onFrameEnd;
+
+  // Frame pacing is credit based. The server grants the client frame credits and the
+  // client uses one for each frame until the server returns it, so the client can have
+  // as many frames in flight as it has been granted credits. When frames drain slower
+  // than the client produces them, the client runs out of credits and waits; frames are
+  // never dropped. onFrame is called when a credit is available and the pacing interval
+  // has passed since the previous frame started. The interval is the measured time it
+  // takes a frame to drain (endFrame to credit return) divided by the number of credits,
+  // and at least minFrameInterval.
+  double minFrameInterval = 0; // seconds
+
+  // sendFrameCredits grants the client n more frame credits (server)
+  bool sendFrameCredits(uint32_t n);
+
+  // endFrame ends the frame started by onFrame (client)
+  bool endFrame();
+
+  uint32_t frameCredits() const {
+    return _frameCredits;
+  }
+  double frameDrainTime() const {
+    return _frameDrainTime;
+  }
+
+  ~DawnRemoteProtocol();
+
   int fd() const {
     return _io.fd;
   }
 
-  void start(RunLoop* rl, int fd);
+  // start begins reading from and writing to fd.
+  // Returns false if buffers could not be allocated (errno is set.)
+  bool start(RunLoop* rl, int fd);
   void stop();
   bool stopped() const {
     return _rl == nullptr;
   }
 
+  const Stats& stats() const {
+    return _stats;
+  }
+
+  // memoryUsage returns the approximate number of bytes of memory used by buffers
+  size_t memoryUsage() const;
+
+  // cork holds back output until a matching call to uncork, so that everything produced
+  // in between (e.g. Dawn command data and control messages) is written together with a
+  // single syscall. Calls nest.
+  void cork();
+  void uncork();
+
+  // pauseReading stops reading and handling input until resumeReading is called, e.g.
+  // while whatever onDawnBuffer hands commands to is behind. Output is not affected.
+  void pauseReading();
+  void resumeReading();
+
+  // congested returns true from when more than _outqMax bytes of output are waiting to be
+  // written until the peer has read enough for less than half that to be left.
+  // Nothing ever blocks on it; producers which can wait should check it.
+  bool congested() const {
+    return _congested;
+  }
+
+  // pauseWhenCongested stops reading input while the connection is congested (server),
+  // so that a peer which doesn't read its replies can't make us queue more of them.
+  // Only one end may set it, or two peers could each wait for the other to read.
+  bool pauseWhenCongested = false;
+
+  bool sendHello();
   bool sendFrameSignal();
   bool sendFramebufferInfo(const FramebufferInfo& info);
   bool sendReservation(const dawn_wire::ReservedSwapChain& scr);
 
+  // sendSharedMemory passes fd, a shared memory object of size bytes, to the peer.
+  // It is delivered after any Dawn command data serialized before this call and before
+  // any serialized after it. Takes ownership of fd. Requires fdPassing.
+  bool sendSharedMemory(uint32_t id, uint64_t size, int fd);
+
   // dawn_wire::CommandSerializer
   size_t GetMaximumAllocationSize() const override;
   void* GetCmdSpace(size_t size) override;
@@ -97,7 +285,27 @@ struct DawnRemoteProtocol : public dawn::wire::CommandSerializer {
     }
   }
   void setNeedsWriteFlush2();
+  void outputAdded();
+  bool hasPendingOutput() const {
+    return _outqHead != nullptr || _wbuf.len() > 0;
+  }
+  OutChunk* allocOutChunk(size_t payloadSize);
+  void freeOutChunk(OutChunk*);
+  void sealOutChunk();
+  bool compressOutChunk(OutChunk** cp);
+  void enqueueOutChunk(OutChunk*);
+  ssize_t sendOutChunkFD();
+  ssize_t readFromSocket(size_t nbyte);
+  bool updateCongestion();
+  bool readingPaused() const {
+    return _readPaused || (_congested && pauseWhenCongested);
+  }
+  void updateReading();
+  ssize_t writeOut();
+  void flushOutput();
   void doIO(int revents);
+  void readIn();
   bool readMsg();
   bool maybeReadIncomingDawnCmd();
+  bool readIncomingDawnStream();
 };
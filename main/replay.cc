@@ -0,0 +1,254 @@
+// replay feeds a capture file (see capture.hh; recorded by the server with
+// DAWN_SERVER_CAPTURE_DIR) into a WireServer and reports how fast the server side
+// handled it. Replies are discarded. Shared memory regions are recreated empty, so data
+// the client wrote into mapped buffers reads as zeros.
+//
+// usage: replay [-p] [-n N] FILE
+//   -p    keep the original pace; by default records are replayed as fast as possible
+//   -n N  replay N times, with a new WireServer each time (default 1)
+
+#define DLOG_PREFIX "\e[1;33m[replay]\e[0m "
+
+#include "capture.hh"
+#include "common.hh"
+#include "memtransfer.hh"
+#include "metrics.hh"
+#include "objcache.hh"
+#include "shm.hh"
+
+#include <dawn/dawn_proc.h>
+#include <dawn/native/DawnNative.h>
+#include <dawn/webgpu_cpp.h>
+#include <dawn/wire/WireServer.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <time.h>
+#include <unistd.h>
+
+// ReplySink is the WireServer's serializer; it counts and discards replies
+class ReplySink : public dawn::wire::CommandSerializer {
+public:
+  uint64_t bytes = 0;
+
+  size_t GetMaximumAllocationSize() const override {
+    return DAWNCMD_STREAM_MAX;
+  }
+  void* GetCmdSpace(size_t size) override {
+    if (_buf.size() < size) {
+      _buf.resize(size);
+    }
+    bytes += size;
+    return _buf.data();
+  }
+  bool Flush() override {
+    return true;
+  }
+
+private:
+  std::vector<char> _buf;
+};
+
+struct ReplayResult {
+  uint64_t commandBuffers = 0;
+  uint64_t commandBytes = 0;
+  uint64_t frames = 0;
+  uint64_t handleTime = 0; // ns in HandleCommands
+  uint64_t wallTime = 0;   // ns, including waiting for the GPU at the end
+  uint64_t replyBytes = 0;
+  Histogram handleTimes;
+};
+
+static std::unique_ptr<dawn_native::Instance> instance;
+static DawnProcTable wireProcs;
+static wgpu::Device device;
+
+static bool createDevice() {
+  instance = std::make_unique<dawn_native::Instance>();
+  instance->DiscoverDefaultAdapters();
+  dawn_native::Adapter adapter;
+  bool found = false;
+  for (auto&& a : instance->GetAdapters()) {
+    wgpu::AdapterProperties p;
+    a.GetProperties(&p);
+    if (p.backendType != wgpu::BackendType::Null) {
+      dlog("using adapter %s (%s)", p.name, backendTypeName(p.backendType));
+      adapter = a;
+      found = true;
+      break;
+    }
+  }
+  if (!found) {
+    errlog("no adapter found");
+    return false;
+  }
+  DawnProcTable nativeProcs = dawn_native::GetProcs();
+  dawnProcSetProcs(&nativeProcs);
+  wireProcs = nativeProcs;
+  objectCacheInstall(&wireProcs); // as in the server
+  device = wgpu::Device::Acquire(adapter.CreateDevice());
+  if (!device) {
+    errlog("failed to create device");
+    return false;
+  }
+  device.SetUncapturedErrorCallback(printDeviceError, nullptr);
+  return true;
+}
+
+// waitForGPU waits until all work submitted to the device has completed
+static void waitForGPU() {
+  bool done = false;
+  device.GetQueue().OnSubmittedWorkDone(
+    0, [](WGPUQueueWorkDoneStatus status, void* userdata) { *(bool*)userdata = true; }, &done);
+  while (!done) {
+    device.Tick();
+    usleep(50);
+  }
+}
+
+static void sleepUntil(uint64_t t) {
+  uint64_t now = metricsNow();
+  if (t > now) {
+    struct timespec ts = {.tv_sec = (time_t)((t - now) / 1000000000ull),
+                          .tv_nsec = (long)((t - now) % 1000000000ull)};
+    nanosleep(&ts, nullptr);
+  }
+}
+
+static bool replayOnce(CaptureReader& capture, bool paced, ReplayResult* res) {
+  ReplySink sink;
+  ShmTransferServer memTransfer; // must outlive wireServer
+  dawn_wire::WireServer wireServer({
+    .procs = &wireProcs,
+    .serializer = &sink,
+    .memoryTransferService = &memTransfer,
+  });
+  if (!wireServer.InjectInstance(instance->Get(), 1, 0)) { // as in the server
+    errlog("InjectInstance failed");
+    return false;
+  }
+
+  uint64_t start = metricsNow();
+  const CaptureRecord* rec;
+  const char* payload;
+  capture.rewind();
+  while (capture.next(&rec, &payload)) {
+    if (paced) {
+      sleepUntil(start + rec->time);
+    }
+    switch (rec->type) {
+    case CAPTURE_DAWNCMD: {
+      uint64_t t = metricsNow();
+      if (wireServer.HandleCommands(payload, rec->len) == nullptr) {
+        dlog("HandleCommands FAILED");
+      }
+      uint64_t d = metricsNow() - t;
+      res->handleTime += d;
+      res->handleTimes.record(d);
+      res->commandBuffers++;
+      res->commandBytes += rec->len;
+      break;
+    }
+    case CAPTURE_FRAME_END:
+      res->frames++;
+      break;
+    case CAPTURE_RESERVATION: {
+      dawn_wire::ReservedSwapChain scr;
+      if (rec->len != sizeof(scr)) {
+        errlog("invalid reservation record");
+        return false;
+      }
+      memcpy(&scr, payload, sizeof(scr));
+      if (wireServer.GetDevice(scr.deviceId, scr.deviceGeneration) == nullptr &&
+          !wireServer.InjectDevice(device.Get(), scr.deviceId, scr.deviceGeneration)) {
+        dlog("InjectDevice FAILED");
+      }
+      break;
+    }
+    case CAPTURE_SHM: {
+      CaptureShm shm;
+      if (rec->len != sizeof(shm)) {
+        errlog("invalid shared memory record");
+        return false;
+      }
+      memcpy(&shm, payload, sizeof(shm));
+      int fd = shmCreate("replay", (size_t)shm.size);
+      if (fd < 0 || !memTransfer.addRegion(shm.id, shm.size, fd)) {
+        perror("shared memory");
+        return false;
+      }
+      break;
+    }
+    default:
+      dlog("skipping record of unknown type %u", rec->type);
+      break;
+    }
+  }
+  waitForGPU();
+  res->wallTime += metricsNow() - start;
+  res->replyBytes += sink.bytes;
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  bool paced = false;
+  int iterations = 1;
+  int c;
+  while ((c = getopt(argc, argv, "pn:")) != -1) {
+    switch (c) {
+    case 'p':
+      paced = true;
+      break;
+    case 'n':
+      iterations = std::max(1, atoi(optarg));
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-p] [-n N] FILE\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-p] [-n N] FILE\n", argv[0]);
+    return 1;
+  }
+  const char* path = argv[optind];
+  CaptureReader capture;
+  if (!capture.open(path)) {
+    perror(path);
+    return 1;
+  }
+  if (!createDevice()) {
+    return 1;
+  }
+
+  ReplayResult res;
+  for (int i = 0; i < iterations; i++) {
+    if (!replayOnce(capture, paced, &res)) {
+      return 1;
+    }
+  }
+
+  double wall = (double)res.wallTime / 1e9;
+  double handle = (double)res.handleTime / 1e9;
+  printf("%s: %d x %llu command buffers, %llu frames (%s)\n", path, iterations,
+         (unsigned long long)(res.commandBuffers / iterations),
+         (unsigned long long)(res.frames / iterations), paced ? "paced" : "as fast as possible");
+  printf("  wall time      %10.3f s\n", wall);
+  printf("  HandleCommands %10.3f s (p50 %.1f us, p99 %.1f us, max %.1f us)\n", handle,
+         (double)res.handleTimes.percentile(0.5) / 1e3,
+         (double)res.handleTimes.percentile(0.99) / 1e3, (double)res.handleTimes.max() / 1e3);
+  printf("  commands       %10.1f MB/s (%.1f MB/s in HandleCommands)\n",
+         (double)res.commandBytes / wall / (1024 * 1024),
+         handle > 0 ? (double)res.commandBytes / handle / (1024 * 1024) : 0.);
+  if (res.frames > 0) {
+    printf("  frames         %10.1f /s\n", (double)res.frames / wall);
+  }
+  printf("  replies        %10llu bytes\n", (unsigned long long)res.replyBytes);
+
+  // release the device before the instance
+  device = nullptr;
+  instance.reset();
+  return 0;
+}
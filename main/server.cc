@@ -14,80 +14,291 @@
 
 #define DLOG_PREFIX "\e[1;34m[server]\e[0m "
 
+#include "adaptercache.hh"
+#include "capture.hh"
 #include "common.hh"
+#include "devicepool.hh"
+#include "diskcache.hh"
+#include "executor.hh"
+#include "memtransfer.hh"
+#include "metrics.hh"
+#include "objcache.hh"
 #include "protocol.hh"
+#include "tracering.hh"
 
 #include <dawn/dawn_proc.h>
 #include <dawn/native/DawnNative.h>
 #include <dawn/webgpu_cpp.h>
 #include <dawn/wire/WireServer.h>
+#if defined(DAWN_ENABLE_BACKEND_D3D12)
+#include <dawn/native/D3D12Backend.h>
+#elif defined(DAWN_ENABLE_BACKEND_METAL)
+#include <dawn/native/MetalBackend.h>
+#elif defined(DAWN_ENABLE_BACKEND_VULKAN)
+#include <dawn/native/VulkanBackend.h>
+#endif
 
 #include <algorithm>
 #include <cmath>
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
-#include <fcntl.h> // F_GETFL, O_NONBLOCK etc
+#include <fcntl.h>  // F_GETFL, O_NONBLOCK etc
+#include <signal.h> // SIGUSR2, SIGPIPE
 #include <sys/socket.h>
+#include <sys/stat.h> // mkdir
 #include <sys/un.h>
 #include <unistd.h> // pipe
 
-int createUNIXSocketServer(const char* filename) {
-  /*struct*/ sockaddr_un addr;
-  int fd = createUNIXSocket(filename, &addr);
-  if (fd > -1) {
-    unlink(filename);
-    int acceptQueueSize = 5;
-    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
-        listen(fd, acceptQueueSize) == -1) {
-      int e = errno;
-      close(fd);
-      unlink(filename);
-      errno = e;
-      fd = -1;
+// serverAddr is the address to listen on (see SockAddr)
+const char* serverAddr = SERVER_SOCK;
+SockAddr listenAddr;
+
+// statsAddr is the address of the stats endpoint. A client may send one command line:
+//   metrics     the server's metrics in the Prometheus text format (default)
+//   trace on    start recording events in the trace ring (see tracering.hh)
+//   trace off   stop recording
+//   trace       the trace ring's events as Chrome trace event JSON
+// The server replies and closes the connection. A client that sends nothing gets the
+// metrics, e.g. "socat -u UNIX-CONNECT:/tmp/server-stats.sock -". Empty disables it.
+#define STATS_SOCK "/tmp/server-stats.sock"
+const char* statsAddr = STATS_SOCK;
+
+// SIGUSR2 toggles tracing too. When it turns tracing off, the events are written to
+// traceFile.
+#define TRACE_FILE "/tmp/server-trace.json"
+const char* traceFile = TRACE_FILE;
+
+// adapterCacheFile records the adapter chosen at startup (see createDawnDevice)
+#define ADAPTER_CACHE_FILE "/tmp/dawn-server-adapter.cache"
+const char* adapterCacheFile = ADAPTER_CACHE_FILE;
+
+// cacheDir holds Dawn's compiled shaders and pipelines so that identical modules and
+// pipelines, from any connection and across restarts, skip backend compilation.
+// Empty disables the cache.
+#define CACHE_DIR "/tmp/dawn-server-cache"
+const char* cacheDir = CACHE_DIR;
+static size_t cacheMaxSize = 0; // per adapter; 0 = DiskCache's default
+
+// ServerPlatform gives Dawn the disk cache. Blobs from different adapters or drivers
+// are kept apart in subdirectories named after the adapter fingerprint, each with a
+// DiskCache of its own.
+struct ServerPlatform : public dawn::platform::Platform {
+  dawn::platform::CachingInterface* GetCachingInterface(const void* fingerprint,
+                                                        size_t fingerprintSize) override {
+    std::lock_guard<std::mutex> lock(_mu);
+    std::string name = DiskCache::hashName(fingerprint, fingerprintSize);
+    auto it = _caches.find(name);
+    if (it != _caches.end()) {
+      return it->second.get(); // nullptr if it could not be opened
+    }
+    std::unique_ptr<DiskCache>& cache = _caches[name];
+    std::string dir = cacheDir;
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+      perror(cacheDir);
+      return nullptr;
+    }
+    dir += "/" + name;
+    cache = std::make_unique<DiskCache>();
+    if (cacheMaxSize > 0) {
+      cache->maxSize = cacheMaxSize;
+    }
+    if (!cache->open(dir.c_str())) {
+      perror(dir.c_str());
+      cache.reset();
+      return nullptr;
     }
+    dlog("shader cache %s: %zu entries, %zu bytes", dir.c_str(), cache->entryCount(),
+         cache->totalSize());
+    return cache.get();
   }
-  return fd;
-}
 
-const char* sockfile = SERVER_SOCK;
-static std::unique_ptr<dawn_native::Instance> instance;
+private:
+  std::mutex _mu; // protects _caches
+  std::unordered_map<std::string, std::unique_ptr<DiskCache>> _caches; // by fingerprint hash
+};
+static ServerPlatform serverPlatform;
+static std::unique_ptr<dawn_native::Instance> instance; // after serverPlatform, which it uses
 
 DawnProcTable nativeProcs;
+DawnProcTable wireProcs; // nativeProcs with the object cache, used by wire servers
 dawn_native::Adapter backendAdapter;
 wgpu::Device device;
 wgpu::Surface surface;
 
 void createDawnSwapChain();
 
-// Conn is a connection to a client
+// maximum number of concurrent client connections
+#define MAX_CONNS 64
+
+// dawnMutex guards all use of Dawn (the instance, the device and every WireServer), which
+// is not thread safe. Socket I/O, message framing and decompression run in parallel on the
+// worker threads; only command execution is serialized.
+static std::mutex dawnMutex;
+
+struct Conn;
+
+// Worker runs an event loop on its own thread and serves the connections handed to it.
+// Accepted file descriptors are passed from the main thread via pendingFds & wakeup.
+struct Worker {
+  uint32_t id = 0;
+  RunLoop* rl = nullptr;
+  std::thread thread;
+  ev_async wakeup;     // pendingFds has changed or quit was set
+  ev_check connReaper; // deletes closedConns
+  std::atomic<uint32_t> nconns{0};
+
+  std::mutex mu; // protects pendingFds and quit
+  std::vector<int> pendingFds;
+  bool quit = false;
+
+  // only accessed on the worker's thread.
+  // Closed connections are moved to closedConns and deleted by connReaper at the end of
+  // the event loop iteration, since they may be closed from within their own callbacks.
+  std::unordered_map<uint32_t, Conn*> conns; // keyed by Conn::id
+  std::vector<Conn*> closedConns;
+};
+
+static std::vector<Worker*> workers;
+static std::atomic<size_t> connCount{0}; // total number of connections, across workers
+static size_t maxConns = MAX_CONNS;
+
+// execThreads enables running each connection's Dawn commands on a separate thread,
+// overlapping command execution with socket I/O (see CommandExecutor)
+static bool execThreads = false;
+
+// With devicePoolSize > 0, each connection gets a device of its own from devicePool,
+// isolating clients from each other's device loss and load. A connection for which no
+// device can be created is refused. Otherwise all connections share the global device.
+static size_t devicePoolSize = 0;
+static DevicePool devicePool;
+
+// captureDir, when set, is where each connection records what its client sends, to
+// conn-PID-ID.dwc (see capture.hh and replay.cc). The server's pid keeps a restarted
+// server, whose connection ids start over, from overwriting earlier captures.
+const char* captureDir = nullptr;
+
+// frameCredits is the number of frames a client may have in flight (see
+// DawnRemoteProtocol::sendFrameCredits)
+#define FRAME_CREDITS 3
+static uint32_t frameCredits = FRAME_CREDITS;
+
+// statsConns lists the started connections, for the stats endpoint. A connection is
+// removed when it closes, before it is deleted. Its metrics may be read from any thread.
+static std::mutex statsMu;
+static std::vector<Conn*> statsConns;
+
+// Conn is a connection to a client. Each connection has its own WireServer; all share the
+// same device. A connection belongs to a worker and is only accessed on its thread.
+// Conn must be created and deleted with dawnMutex locked.
+//
+// Dawn may serialize a connection's replies on any thread: a callback (e.g. a buffer
+// mapping or queue completion) can fire while another connection's commands execute on
+// the shared device. The WireServer therefore serializes into _executor, which hands the
+// replies to the connection's own thread, where they are written to _proto.
 struct Conn {
   uint32_t id;
+  Worker* _worker = nullptr;
+  int _fd = -1;
+  bool _closed = false;
+  wgpu::Device _device; // device used for this connection
   DawnRemoteProtocol _proto;
+  ShmTransferServer _memTransfer; // must outlive _wireServer
+  CommandExecutor _executor;      // reply buffer; also runs commands with execThreads
   dawn_wire::WireServer _wireServer;
+  Histogram _handleTime; // ns spent in HandleCommands; written by the exec thread if any
+  CaptureWriter _capture;
+
+  Conn(uint32_t id_)
+    : id(id_)
+    , _wireServer({
+        .procs = &wireProcs,
+        .serializer = &_executor,
+        .memoryTransferService = &_memTransfer,
+      }) {
+    _proto.traceId = id;
+    _proto.fdPassing = !listenAddr.tcp; // for ShmTransferServer; clients over TCP don't use it
+    _proto.features = DawnRemoteProtocol::FeatureCompression; // used if the client asks for it
+    _proto.pauseWhenCongested = true; // stop reading from a client which doesn't read replies
+    _proto.onSharedMemory = [this](uint32_t regionId, uint64_t size, int fd) {
+      dlog("onSharedMemory id=%u size=%llu", regionId, (unsigned long long)size);
+      _memTransfer.addRegion(regionId, size, fd);
+    };
+
+    _executor.execute = [this](const char* data, size_t len) {
+      std::lock_guard<std::mutex> lock(dawnMutex);
+      if (len > 0) {
+        uint64_t t = metricsNow();
+        if (_wireServer.HandleCommands(data, len) == nullptr) {
+          dlog("execute: _wireServer.HandleCommands FAILED");
+        }
+        uint64_t now = metricsNow();
+        _handleTime.record(now - t);
+        traceSpan(TRACE_HANDLE_COMMANDS, id, t, now, len);
+      }
+      _executor.Flush();
+    };
 
-  Conn(uint32_t id_) : id(id_), _wireServer({.procs = &nativeProcs, .serializer = &_proto}) {
     _proto.onDawnBuffer = [this](const char* data, size_t len) {
       dlog("onDawnBuffer len=%zu", len);
       assert(data != nullptr);
-      if (_wireServer.HandleCommands(data, len) == nullptr) {
-        dlog("onDawnBuffer: _wireServer.HandleCommands FAILED");
+      if (execThreads) {
+        if (!_executor.submit(data, len)) {
+          dlog("onDawnBuffer: _executor.submit FAILED");
+        }
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(dawnMutex);
+        uint64_t t = metricsNow();
+        if (_wireServer.HandleCommands(data, len) == nullptr) {
+          dlog("onDawnBuffer: _wireServer.HandleCommands FAILED");
+        }
+        uint64_t now = metricsNow();
+        _handleTime.record(now - t);
+        traceSpan(TRACE_HANDLE_COMMANDS, id, t, now, len);
+        _executor.Flush();
+      }
+      // Write replies without holding dawnMutex, since that may wait for the client to
+      // read (backpressure) and would hold up every other connection
+      _executor.deliverReplies();
+    };
+
+    // Return a frame's credit once its commands have been handled
+    _proto.onFrameEnd = [this]() {
+      if (execThreads) {
+        _executor.submitMarker();
+      } else {
+        _proto.sendFrameCredits(1);
       }
-      if (!_proto.Flush()) {
-        dlog("_proto.Flush() FAILED");
+    };
+    _executor.onMarker = [this]() { _proto.sendFrameCredits(1); };
+    _executor.onQueueFull = [this](bool full) {
+      if (full) {
+        _proto.pauseReading();
+      } else {
+        _proto.resumeReading();
       }
     };
 
     _proto.onSwapchainReservation = [this](const dawn_wire::ReservedSwapChain& scr) {
       this->onSwapchainReservation(scr);
     };
+
+    _proto.onClose = [this]() { close(); };
   }
 
   void onSwapchainReservation(const dawn_wire::ReservedSwapChain& scr) {
     dlog("onSwapchainReservation device: %u %u, swapchain %u %u\n", scr.deviceId,
          scr.deviceGeneration, scr.id, scr.generation);
 
+    std::lock_guard<std::mutex> lock(dawnMutex);
     if (_wireServer.GetDevice(scr.deviceId, scr.deviceGeneration) == nullptr) {
-      if (_wireServer.InjectDevice(device.Get(), scr.deviceId, scr.deviceGeneration)) {
+      if (_wireServer.InjectDevice(_device.Get(), scr.deviceId, scr.deviceGeneration)) {
         dlog("onSwapchainReservation _wireServer.InjectDevice OK");
       } else {
         dlog("onSwapchainReservation _wireServer.InjectDevice FAILED");
@@ -95,32 +306,105 @@ struct Conn {
     }
   }
 
-  void start(RunLoop* rl, int fd) {
-    _proto.start(rl, fd);
+  bool start(Worker* worker, int fd) {
+    _worker = worker;
+    _fd = fd;
+    if (devicePoolSize > 0) {
+      _device = devicePool.take();
+      if (!_device) {
+        // sharing the global device instead would break the isolation asked for
+        errlog("client #%u: failed to create a device; refusing the connection", id);
+        errno = ENODEV;
+        return false;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(statsMu);
+      statsConns.push_back(this);
+    }
+    if (captureDir != nullptr) {
+      std::string path = std::string(captureDir) + "/conn-" + std::to_string(getpid()) + "-" +
+                         std::to_string(id) + ".dwc";
+      if (_capture.open(path.c_str())) {
+        _proto.capture = &_capture;
+        dlog("capturing client #%u to %s", id, path.c_str());
+      } else {
+        perror(path.c_str());
+      }
+    }
+    if (!_proto.start(worker->rl, fd)) {
+      return false;
+    }
+    _executor.maxAllocationSize = _proto.maxCmdSize;
+    _executor.start(worker->rl, &_proto, execThreads);
+    _proto.sendFrameCredits(frameCredits);
 
     // Hardcoded generation and IDs need to match what's produced by the client
     // or be sent over through the wire.
+    std::lock_guard<std::mutex> lock(dawnMutex);
+    if (!_device) {
+      _device = device;
+    }
     if (_wireServer.InjectInstance(instance->Get(), 1, 0)) {
       dlog("onSwapchainReservation _wireServer.InjectInstance OK");
     } else {
       dlog("onSwapchainReservation _wireServer.InjectInstance FAILED");
     };
+    return true;
   }
 
   void close();
 };
 
-Conn* conn0 = nullptr;
+static void reapClosedConns(RunLoop* rl, ev_check* w, int revents) {
+  Worker* worker = (Worker*)w->data;
+  for (Conn* conn : worker->closedConns) {
+    conn->_executor.join(); // outside of dawnMutex, which the exec thread may be waiting for
+  }
+  {
+    std::lock_guard<std::mutex> lock(dawnMutex);
+    for (Conn* conn : worker->closedConns) {
+      delete conn;
+    }
+  }
+  worker->closedConns.clear();
+  ObjectCacheStats s = objectCacheStats();
+  dlog("object cache: %zu shader modules (%llu hits, %llu misses),"
+       " %zu compute pipelines (%llu hits, %llu misses)",
+       s.shaderModules.entries, (unsigned long long)s.shaderModules.hits,
+       (unsigned long long)s.shaderModules.misses, s.computePipelines.entries,
+       (unsigned long long)s.computePipelines.hits, (unsigned long long)s.computePipelines.misses);
+  ev_check_stop(rl, w);
+}
 
 void Conn::close() {
-  _proto.stop();
-  if (_proto.fd() != -1) {
-    ::close(_proto.fd());
+  if (_closed) {
+    return;
   }
-  if (this == conn0) {
-    conn0 = nullptr;
-    delete this;
+  _closed = true;
+  {
+    std::lock_guard<std::mutex> lock(statsMu);
+    auto it = std::find(statsConns.begin(), statsConns.end(), this);
+    if (it != statsConns.end()) {
+      statsConns.erase(it);
+    }
   }
+  size_t memusage = _proto.memoryUsage();
+  _executor.stop();
+  _proto.stop();
+  _proto.capture = nullptr;
+  _capture.close();
+  if (_fd != -1) {
+    ::close(_fd);
+    _fd = -1;
+  }
+  connCount--;
+  _worker->conns.erase(id);
+  _worker->nconns--;
+  dlog("client #%u disconnected (%zu kB of buffers; %zu clients connected)", id,
+       memusage / 1024, connCount.load());
+  _worker->closedConns.push_back(this);
+  ev_check_start(_worker->rl, &_worker->connReaper);
 }
 
 // backendType
@@ -153,27 +437,87 @@ void logAvailableAdapters(dawn_native::Instance* instance) {
   }
 }
 
-void createDawnDevice() {
+// discoverBackendAdapters discovers the adapters of backendType only, which is much faster
+// than probing every backend. Returns false if that is not supported for backendType.
+static bool discoverBackendAdapters() {
+#if defined(DAWN_ENABLE_BACKEND_D3D12)
+  dawn_native::d3d12::AdapterDiscoveryOptions options;
+  return instance->DiscoverAdapters(&options);
+#elif defined(DAWN_ENABLE_BACKEND_METAL)
+  dawn_native::metal::AdapterDiscoveryOptions options;
+  return instance->DiscoverAdapters(&options);
+#elif defined(DAWN_ENABLE_BACKEND_VULKAN)
+  dawn_native::vulkan::AdapterDiscoveryOptions options;
+  return instance->DiscoverAdapters(&options);
+#else
+  return false;
+#endif
+}
+
+// findAdapter looks for an adapter of backendType (and matching cached, if not null)
+// among the adapters discovered so far
+static bool findAdapter(const AdapterCacheEntry* cached, dawn_native::Adapter* adapterOut) {
+  for (auto&& adapter : instance->GetAdapters()) {
+    wgpu::AdapterProperties properties;
+    adapter.GetProperties(&properties);
+    if (properties.backendType != backendType) {
+      continue;
+    }
+    if (cached != nullptr) {
+      wgpu::SupportedLimits limits;
+      if (!adapter.GetLimits(&limits) || !cached->matches(properties, limits.limits)) {
+        continue;
+      }
+    }
+    dlog("using adapter %s", properties.name);
+    *adapterOut = adapter;
+    return true;
+  }
+  return false;
+}
+
+// createDawnDevice discovers adapters and creates the shared device. Probing every
+// backend is slow, so the chosen adapter is recorded in adapterCacheFile and on the next
+// start, when that adapter is still around with the same limits, only its backend is probed.
+// Runs on a background thread while the server already accepts connections.
+bool createDawnDevice() {
+  std::lock_guard<std::mutex> lock(dawnMutex);
   instance = std::make_unique<dawn_native::Instance>();
-  instance->DiscoverDefaultAdapters();
+  if (*cacheDir) {
+    instance->SetPlatform(&serverPlatform);
+  }
 
-  logAvailableAdapters(instance.get());
+  AdapterCacheEntry cached;
+  bool haveCached = adapterCacheLoad(adapterCacheFile, &cached) &&
+                    cached.backendType == backendType;
+  bool found = haveCached && discoverBackendAdapters() && findAdapter(&cached, &backendAdapter);
+  if (!found) {
+    if (haveCached) {
+      dlog("cached adapter \"%s\" not found or its limits changed; discovering all adapters",
+           cached.name.c_str());
+    }
+    instance->DiscoverDefaultAdapters();
+    logAvailableAdapters(instance.get());
+    if (!findAdapter(nullptr, &backendAdapter)) {
+      errlog("no adapter found for backend %s", backendTypeName(backendType));
+      return false;
+    }
+  }
 
-  // Get an adapter for the backend to use, and create the device.
-  {
-    std::vector<dawn_native::Adapter> adapters = instance->GetAdapters();
-    auto adapterIt = std::find_if(adapters.begin(), adapters.end(),
-                                  [](const dawn_native::Adapter adapter) -> bool {
-                                    wgpu::AdapterProperties properties;
-                                    adapter.GetProperties(&properties);
-                                    if (properties.backendType == backendType) {
-                                      dlog("using adapter %s", properties.name);
-                                      return true;
-                                    }
-                                    return false;
-                                  });
-    assert(adapterIt != adapters.end());
-    backendAdapter = *adapterIt; // global var
+  // update the cache
+  AdapterCacheEntry entry;
+  wgpu::AdapterProperties properties;
+  backendAdapter.GetProperties(&properties);
+  entry.backendType = properties.backendType;
+  entry.name = properties.name != nullptr ? properties.name : "";
+  entry.vendorID = properties.vendorID;
+  entry.deviceID = properties.deviceID;
+  wgpu::SupportedLimits limits;
+  if (backendAdapter.GetLimits(&limits)) {
+    entry.limits = limits.limits;
+  }
+  if (!(haveCached && entry == cached) && !adapterCacheStore(adapterCacheFile, entry)) {
+    perror("adapterCacheStore");
   }
 
   // Set up the native procs for the global proctable (so calling
@@ -181,11 +525,153 @@ void createDawnDevice() {
   // so we can give it to the wire server.
   nativeProcs = dawn_native::GetProcs(); // global var
   dawnProcSetProcs(&nativeProcs);
+  wireProcs = nativeProcs;
+  objectCacheInstall(&wireProcs);
 
   device = wgpu::Device::Acquire(backendAdapter.CreateDevice()); // global var
+  if (!device) {
+    errlog("failed to create device");
+    return false;
+  }
 
   // hook up error reporting
   device.SetUncapturedErrorCallback(printDeviceError, nullptr);
+  return true;
+}
+
+// onWorkerWakeup is called on a worker's thread when it has been handed new connections
+static void onWorkerWakeup(RunLoop* rl, ev_async* w, int revents) {
+  Worker* worker = (Worker*)w->data;
+  std::vector<int> fds;
+  bool quit;
+  {
+    std::lock_guard<std::mutex> lock(worker->mu);
+    fds.swap(worker->pendingFds);
+    quit = worker->quit;
+  }
+  if (quit) {
+    for (int fd : fds) {
+      close(fd);
+      connCount--;
+    }
+    ev_break(rl, EVBREAK_ALL);
+    return;
+  }
+  static std::atomic<uint32_t> connIdGen{0};
+  for (int fd : fds) {
+    Conn* conn;
+    {
+      std::lock_guard<std::mutex> lock(dawnMutex);
+      conn = new Conn(connIdGen++);
+    }
+    worker->conns[conn->id] = conn;
+    worker->nconns++;
+    dlog("client #%u connected on fd %d (worker %u, %zu clients connected)", conn->id, fd,
+         worker->id, connCount.load());
+    if (!conn->start(worker, fd)) {
+      perror("Conn::start");
+      conn->close();
+    }
+  }
+}
+
+static void workerMain(Worker* worker) {
+  ev_run(worker->rl, 0);
+  while (!worker->conns.empty()) {
+    worker->conns.begin()->second->close();
+  }
+  reapClosedConns(worker->rl, &worker->connReaper, 0);
+}
+
+static void startWorkers(uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    Worker* worker = new Worker();
+    worker->id = i;
+    worker->rl = ev_loop_new(EVFLAG_AUTO);
+    worker->wakeup.data = worker;
+    ev_async_init(&worker->wakeup, onWorkerWakeup);
+    ev_async_start(worker->rl, &worker->wakeup);
+    worker->connReaper.data = worker;
+    ev_check_init(&worker->connReaper, reapClosedConns);
+    worker->thread = std::thread(workerMain, worker);
+    workers.push_back(worker);
+  }
+}
+
+static void stopWorkers() {
+  for (Worker* worker : workers) {
+    {
+      std::lock_guard<std::mutex> lock(worker->mu);
+      worker->quit = true;
+    }
+    ev_async_send(worker->rl, &worker->wakeup);
+  }
+  for (Worker* worker : workers) {
+    worker->thread.join();
+    ev_async_stop(worker->rl, &worker->wakeup);
+    ev_loop_destroy(worker->rl);
+    delete worker;
+  }
+  workers.clear();
+}
+
+// pickWorker returns the worker with the fewest connections, going round-robin among
+// equally loaded workers
+static Worker* pickWorker() {
+  static uint32_t next = 0;
+  Worker* best = nullptr;
+  for (size_t i = 0; i < workers.size(); i++) {
+    Worker* worker = workers[(next + i) % workers.size()];
+    if (best == nullptr || worker->nconns < best->nconns) {
+      best = worker;
+    }
+  }
+  next = (best->id + 1) % workers.size();
+  return best;
+}
+
+// createPooledDevice creates a device for devicePool
+static wgpu::Device createPooledDevice() {
+  std::lock_guard<std::mutex> lock(dawnMutex);
+  WGPUDevice d = backendAdapter.CreateDevice();
+  if (d == nullptr) {
+    return nullptr;
+  }
+  wgpu::Device dev = wgpu::Device::Acquire(d);
+  dev.SetUncapturedErrorCallback(printDeviceError, nullptr);
+  dev.SetDeviceLostCallback(printDeviceLostCallback, nullptr);
+  return dev;
+}
+
+// Connections accepted before the device is ready wait in waitingFds.
+// The discovery thread signals deviceReadyAsync when it's done.
+static bool deviceReady = false; // main thread only
+static std::vector<int> waitingFds;
+static ev_async deviceReadyAsync;
+static std::thread discoveryThread;
+static bool discoveryOK = false;
+
+static void dispatchConn(int fd);
+
+// onDeviceReady is called on the main thread when createDawnDevice has finished
+static void onDeviceReady(RunLoop* rl, ev_async* w, int revents) {
+  ev_async_stop(rl, w);
+  discoveryThread.join();
+  if (!discoveryOK) {
+    ev_break(rl, EVBREAK_ALL);
+    return;
+  }
+  deviceReady = true;
+  if (devicePoolSize > 0) {
+    dlog("keeping %zu devices ready", devicePoolSize);
+    devicePool.createDevice = createPooledDevice;
+    devicePool.start(devicePoolSize);
+  }
+  dlog("device ready (%zu clients waiting)", waitingFds.size());
+  for (int fd : waitingFds) {
+    dispatchConn(fd);
+  }
+  waitingFds.clear();
 }
 
 // onServerIO is called when a new connection is awaiting accept
@@ -199,28 +685,240 @@ static void onServerIO(RunLoop* rl, ev_io* w, int revents) {
     return;
   }
   FDSetNonBlock(fd);
+  if (listenAddr.tcp) {
+    tuneTCPSocket(fd);
+  }
+
+  if (connCount >= maxConns) {
+    errlog("too many clients (%zu); refusing connection", connCount.load());
+    close(fd);
+    return;
+  }
+  connCount++;
+
+  if (!deviceReady) {
+    dlog("device not ready yet; queueing client");
+    waitingFds.push_back(fd);
+    return;
+  }
+  dispatchConn(fd);
+}
+
+// formatStats returns the server's metrics in the Prometheus text format
+static std::string formatStats() {
+  MetricsWriter w;
+  w.type("dawn_server_connections", "gauge", "Connected clients.");
+  w.value("dawn_server_connections", "", (uint64_t)connCount.load());
+
+  ObjectCacheStats oc = objectCacheStats();
+  const char* kinds[] = {"kind=\"shader_module\"", "kind=\"compute_pipeline\""};
+  const ObjectCacheCounts* counts[] = {&oc.shaderModules, &oc.computePipelines};
+  w.type("dawn_server_object_cache_hits_total", "counter", "Object cache hits.");
+  for (int i = 0; i < 2; i++) {
+    w.value("dawn_server_object_cache_hits_total", kinds[i], counts[i]->hits);
+  }
+  w.type("dawn_server_object_cache_misses_total", "counter", "Object cache misses.");
+  for (int i = 0; i < 2; i++) {
+    w.value("dawn_server_object_cache_misses_total", kinds[i], counts[i]->misses);
+  }
+  w.type("dawn_server_object_cache_entries", "gauge", "Live objects in the object cache.");
+  for (int i = 0; i < 2; i++) {
+    w.value("dawn_server_object_cache_entries", kinds[i], (uint64_t)counts[i]->entries);
+  }
+
+  std::lock_guard<std::mutex> lock(statsMu);
+  std::vector<std::string> labels;
+  for (Conn* conn : statsConns) {
+    labels.push_back("conn=\"" + std::to_string(conn->id) + "\"");
+  }
+  struct {
+    const char* name;
+    const char* help;
+    const Counter& (*get)(const DawnRemoteProtocol::Stats&);
+  } counters[] = {
+    {"dawn_conn_bytes_in_total", "Bytes read from the client.",
+     [](const DawnRemoteProtocol::Stats& s) -> const Counter& { return s.bytesIn; }},
+    {"dawn_conn_bytes_out_total", "Bytes written to the client.",
+     [](const DawnRemoteProtocol::Stats& s) -> const Counter& { return s.bytesOut; }},
+    {"dawn_conn_payload_copies_total", "Command payloads copied out of the read buffer.",
+     [](const DawnRemoteProtocol::Stats& s) -> const Counter& { return s.payloadCopies; }},
+    {"dawn_conn_payload_copy_bytes_total", "Bytes of command payloads copied.",
+     [](const DawnRemoteProtocol::Stats& s) -> const Counter& { return s.payloadCopyBytes; }},
+  };
+  for (auto& c : counters) {
+    w.type(c.name, "counter", c.help);
+    for (size_t i = 0; i < statsConns.size(); i++) {
+      w.value(c.name, labels[i], c.get(statsConns[i]->_proto.stats()).get());
+    }
+  }
+  w.type("dawn_conn_msgs_in_total", "counter", "Messages read from the client, by type.");
+  for (size_t i = 0; i < statsConns.size(); i++) {
+    const DawnRemoteProtocol::Stats& ps = statsConns[i]->_proto.stats();
+    for (int t = 0; t < 128; t++) {
+      if (uint64_t n = ps.msgsIn[t].get()) {
+        w.value("dawn_conn_msgs_in_total", labels[i] + ",type=\"" + (char)t + "\"", n);
+      }
+    }
+  }
+  w.type("dawn_conn_msgs_out_total", "counter", "Messages written to the client, by type.");
+  for (size_t i = 0; i < statsConns.size(); i++) {
+    const DawnRemoteProtocol::Stats& ps = statsConns[i]->_proto.stats();
+    for (int t = 0; t < 128; t++) {
+      if (uint64_t n = ps.msgsOut[t].get()) {
+        w.value("dawn_conn_msgs_out_total", labels[i] + ",type=\"" + (char)t + "\"", n);
+      }
+    }
+  }
+  w.type("dawn_conn_handle_commands_seconds", "summary", "Time spent in HandleCommands.");
+  for (size_t i = 0; i < statsConns.size(); i++) {
+    w.summary("dawn_conn_handle_commands_seconds", labels[i], statsConns[i]->_handleTime, 1e-9);
+  }
+  w.type("dawn_conn_flush_drain_seconds", "summary",
+         "Time from output being queued until all queued output was written.");
+  for (size_t i = 0; i < statsConns.size(); i++) {
+    w.summary("dawn_conn_flush_drain_seconds", labels[i],
+              statsConns[i]->_proto.stats().flushDrain, 1e-9);
+  }
+  return std::move(w.out);
+}
+
+// StatsConn is a connection to the stats endpoint, waiting for its command line.
+// Without one (EOF, or nothing within STATS_CMD_TIMEOUT seconds) it gets the metrics.
+#define STATS_CMD_TIMEOUT 0.1
+#define STATS_CMD_MAX 64
+struct StatsConn {
+  ev_io io;
+  ev_timer timer;
+  std::string cmd;
+};
+
+// statsReply replies to sc's command and closes sc
+static void statsReply(RunLoop* rl, StatsConn* sc) {
+  ev_io_stop(rl, &sc->io);
+  ev_timer_stop(rl, &sc->timer);
+  int fd = sc->io.fd;
+  std::string cmd = sc->cmd.substr(0, sc->cmd.find_first_of("\r\n"));
+  delete sc;
+
+  std::string text;
+  if (cmd.empty() || cmd == "metrics") {
+    text = formatStats();
+  } else if (cmd == "trace on" || cmd == "trace off") {
+    traceEnable(cmd == "trace on");
+    dlog("tracing %s", traceEnabled() ? "on" : "off");
+    text = "ok\n";
+  } else if (cmd == "trace") {
+    text = traceExportJSON();
+  } else {
+    text = "unknown command\n";
+  }
+
+  // The reply is written in one go; don't let a stuck reader hold up this thread for long
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  struct timeval tv = {.tv_sec = 1, .tv_usec = 0};
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  for (size_t offs = 0; offs < text.size();) {
+    ssize_t n = send(fd, text.data() + offs, text.size() - offs, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("stats write");
+      break;
+    }
+    offs += (size_t)n;
+  }
+  close(fd);
+}
+
+static void onStatsConnIO(RunLoop* rl, ev_io* w, int revents) {
+  StatsConn* sc = (StatsConn*)w->data;
+  char buf[STATS_CMD_MAX];
+  ssize_t n = read(w->fd, buf, sizeof(buf));
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  if (n > 0) {
+    sc->cmd.append(buf, (size_t)n);
+    if (sc->cmd.find('\n') == std::string::npos && sc->cmd.size() < STATS_CMD_MAX) {
+      return; // need more
+    }
+  }
+  statsReply(rl, sc);
+}
+
+static void onStatsConnTimeout(RunLoop* rl, ev_timer* w, int revents) {
+  statsReply(rl, (StatsConn*)w->data);
+}
+
+// onStatsIO accepts a connection to the stats endpoint
+static void onStatsIO(RunLoop* rl, ev_io* w, int revents) {
+  int fd = accept(w->fd, NULL, NULL);
+  if (fd < 0) {
+    if (errno != EAGAIN) {
+      perror("accept");
+    }
+    return;
+  }
+  FDSetNonBlock(fd);
+  StatsConn* sc = new StatsConn();
+  sc->io.data = sc;
+  ev_io_init(&sc->io, onStatsConnIO, fd, EV_READ);
+  ev_io_start(rl, &sc->io);
+  sc->timer.data = sc;
+  ev_timer_init(&sc->timer, onStatsConnTimeout, STATS_CMD_TIMEOUT, 0.);
+  ev_timer_start(rl, &sc->timer);
+}
 
-  if (conn0 != nullptr) {
-    dlog("second client connected; closing older client (last in wins)");
-    conn0->close();
+// onTraceSignal toggles tracing, writing the events to traceFile when turning it off
+static void onTraceSignal(RunLoop* rl, ev_signal* w, int revents) {
+  bool on = !traceEnabled();
+  traceEnable(on);
+  if (on) {
+    dlog("tracing on");
+    return;
+  }
+  std::string json = traceExportJSON();
+  FILE* f = fopen(traceFile, "w");
+  if (f == nullptr || fwrite(json.data(), 1, json.size(), f) != json.size()) {
+    perror(traceFile);
+  } else {
+    dlog("tracing off; events written to %s", traceFile);
+  }
+  if (f != nullptr) {
+    fclose(f);
   }
+}
 
-  static uint32_t connIdGen = 0;
-  conn0 = new Conn(connIdGen++);
-  dlog("client #%u connected on fd %d", conn0->id, fd);
-  conn0->start(rl, fd);
+// dispatchConn hands the connection off to a worker thread
+static void dispatchConn(int fd) {
+  Worker* worker = pickWorker();
+  {
+    std::lock_guard<std::mutex> lock(worker->mu);
+    worker->pendingFds.push_back(fd);
+  }
+  ev_async_send(worker->rl, &worker->wakeup);
 }
 
 int main(int argc, const char* argv[]) {
-  dlog("starting UNIX socket server \"%s\"", sockfile);
-  int fd = createUNIXSocketServer(sockfile);
+  // A client that goes away while we write to it must not take down the server;
+  // the write fails with EPIPE instead and only that connection is closed.
+  signal(SIGPIPE, SIG_IGN);
+
+  if (const char* s = getenv("DAWN_SERVER_ADDR")) {
+    serverAddr = s;
+  }
+  if (!parseSockAddr(serverAddr, &listenAddr)) {
+    errlog("invalid address \"%s\"", serverAddr);
+    return 1;
+  }
+  dlog("starting server on %s", fmtSockAddr(listenAddr).c_str());
+  int fd = listenSocket(listenAddr);
   if (fd < 0) {
-    perror("createUNIXSocketServer");
+    perror("listenSocket");
     return 1;
   }
 
-  createDawnDevice();
-
   RunLoop* rl = EV_DEFAULT;
 
   // register I/O callback for the socket file descriptor
@@ -229,15 +927,102 @@ int main(int argc, const char* argv[]) {
   ev_io_init(&server_fd_watcher, onServerIO, fd, EV_READ);
   ev_io_start(rl, &server_fd_watcher);
 
+  if (const char* s = getenv("DAWN_SERVER_STATS_ADDR")) {
+    statsAddr = s;
+  }
+  SockAddr statsSockAddr;
+  ev_io stats_fd_watcher;
+  int statsfd = -1;
+  if (*statsAddr) {
+    if (!parseSockAddr(statsAddr, &statsSockAddr)) {
+      errlog("invalid address \"%s\"", statsAddr);
+      return 1;
+    }
+    statsfd = listenSocket(statsSockAddr);
+    if (statsfd < 0) {
+      perror(fmtSockAddr(statsSockAddr).c_str());
+      return 1;
+    }
+    dlog("stats on %s", fmtSockAddr(statsSockAddr).c_str());
+    FDSetNonBlock(statsfd);
+    ev_io_init(&stats_fd_watcher, onStatsIO, statsfd, EV_READ);
+    ev_io_start(rl, &stats_fd_watcher);
+  }
+
+  if (const char* s = getenv("DAWN_SERVER_TRACE_FILE")) {
+    traceFile = s;
+  }
+  if (getenv("DAWN_SERVER_TRACE") != nullptr) {
+    traceEnable(true);
+  }
+  ev_signal trace_signal_watcher;
+  ev_signal_init(&trace_signal_watcher, onTraceSignal, SIGUSR2);
+  ev_signal_start(rl, &trace_signal_watcher);
+
+  // Worker threads serve connections; this thread only accepts them
+  uint32_t nworkers = std::max(1u, std::thread::hardware_concurrency());
+  if (const char* s = getenv("DAWN_SERVER_THREADS")) {
+    nworkers = std::max(1, atoi(s));
+  }
+  if (const char* s = getenv("DAWN_SERVER_DEVICE_POOL")) {
+    devicePoolSize = (size_t)std::max(0, atoi(s));
+  }
+  if (const char* s = getenv("DAWN_SERVER_ADAPTER_CACHE")) {
+    adapterCacheFile = s;
+  }
+  if (const char* s = getenv("DAWN_SERVER_CAPTURE_DIR")) {
+    captureDir = s;
+  }
+  if (const char* s = getenv("DAWN_SERVER_FRAME_CREDITS")) {
+    frameCredits = (uint32_t)std::max(1, atoi(s));
+  }
+  if (const char* s = getenv("DAWN_SERVER_CACHE_DIR")) {
+    cacheDir = s;
+  }
+  if (const char* s = getenv("DAWN_SERVER_CACHE_SIZE")) {
+    cacheMaxSize = (size_t)strtoull(s, nullptr, 10);
+  }
+
+  execThreads = getenv("DAWN_SERVER_EXEC_THREAD") != nullptr;
+  dlog("starting %u worker threads%s", nworkers, execThreads ? " (with exec threads)" : "");
+  startWorkers(nworkers);
+
+  // Discover adapters & create the device in the background while accepting connections
+  ev_async_init(&deviceReadyAsync, onDeviceReady);
+  ev_async_start(rl, &deviceReadyAsync);
+  discoveryThread = std::thread([rl]() {
+    discoveryOK = createDawnDevice();
+    ev_async_send(rl, &deviceReadyAsync);
+  });
+
   ev_run(rl, 0);
 
   dlog("exit");
-  if (conn0) {
-    conn0->close();
+  if (discoveryThread.joinable()) {
+    discoveryThread.join();
+  }
+  for (int fd : waitingFds) {
+    close(fd);
+  }
+  stopWorkers();
+  {
+    std::deque<wgpu::Device> devices = devicePool.stop();
+    std::lock_guard<std::mutex> lock(dawnMutex);
+    devices.clear();
   }
 
+  ev_signal_stop(rl, &trace_signal_watcher);
   ev_io_stop(rl, &server_fd_watcher);
   close(fd);
-  unlink(sockfile);
-  return 0;
+  if (!listenAddr.tcp) {
+    unlink(listenAddr.path.c_str());
+  }
+  if (statsfd != -1) {
+    ev_io_stop(rl, &stats_fd_watcher);
+    close(statsfd);
+    if (!statsSockAddr.tcp) {
+      unlink(statsSockAddr.path.c_str());
+    }
+  }
+  return discoveryOK ? 0 : 1;
 }
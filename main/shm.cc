@@ -0,0 +1,68 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memfd_create, F_ADD_SEALS
+#endif
+#include "shm.hh"
+
+#include <errno.h>
+#include <fcntl.h> // O_* constants
+#include <stdint.h>
+#include <stdio.h> // snprintf
+#include <sys/mman.h>
+#include <sys/stat.h> // fstat
+#include <unistd.h> // ftruncate, close, getpid
+
+int shmCreate(const char* name, size_t size) {
+#if defined(__linux__)
+  int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+  // No memfd; create a uniquely-named POSIX shared memory object and unlink it right away
+  static unsigned int counter = 0;
+  char path[64];
+  snprintf(path, sizeof(path), "/%.32s.%d.%u", name, (int)getpid(), counter++);
+  int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd > -1) {
+    shm_unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+#endif
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, (off_t)size) == -1) {
+    int e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+  }
+#if defined(__linux__)
+  if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == -1) {
+    int e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+  }
+#endif
+  return fd;
+}
+
+bool shmCheck(int fd, uint64_t size) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    return false;
+  }
+  if (st.st_size < 0 || (uint64_t)st.st_size < size || (size_t)size != size) {
+    errno = EINVAL; // smaller than claimed, or too large to map
+    return false;
+  }
+#if defined(__linux__)
+  int seals = fcntl(fd, F_GET_SEALS);
+  if (seals == -1) {
+    return false;
+  }
+  if ((seals & F_SEAL_SHRINK) == 0) {
+    errno = EPERM;
+    return false;
+  }
+#endif
+  return true;
+}
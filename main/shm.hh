@@ -0,0 +1,14 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// shmCreate creates an anonymous shared memory object of size bytes and returns a
+// file descriptor for it, or -1 on error (errno is set.) The name is only used for
+// debugging; the object is never visible in the file system.
+int shmCreate(const char* name, size_t size);
+
+// shmCheck returns true if fd is a shared memory object of at least size bytes that can
+// safely be mapped by a process other than its creator: on Linux it must also be sealed
+// against shrinking (F_SEAL_SHRINK, which shmCreate applies), as accessing a mapping past
+// the end of a truncated object raises SIGBUS. Sets errno when returning false.
+bool shmCheck(int fd, uint64_t size);
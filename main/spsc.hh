@@ -0,0 +1,47 @@
+#pragma once
+#include <atomic>
+#include <stddef.h>
+
+// SPSCQueue is a lock-free, fixed-capacity FIFO for exactly one producer thread and one
+// consumer thread. Size must be a power of two.
+//
+// push and pop never block. Callers that need to wait for data or space can pair the
+// queue with a std::atomic counter and use its wait/notify_one (see CommandExecutor.)
+template <typename T, size_t Size> struct SPSCQueue {
+  static_assert(Size > 0 && (Size & (Size - 1)) == 0, "Size must be a power of two");
+
+  // read and write positions grow forever; slot index is pos % Size
+  alignas(64) std::atomic<size_t> _r{0}; // written by consumer
+  alignas(64) std::atomic<size_t> _w{0}; // written by producer
+  alignas(64) T _slots[Size];
+
+  // push adds v to the queue. Returns false if the queue is full. Producer only.
+  bool push(const T& v) {
+    size_t w = _w.load(std::memory_order_relaxed);
+    if (w - _r.load(std::memory_order_acquire) == Size) {
+      return false;
+    }
+    _slots[w & (Size - 1)] = v;
+    _w.store(w + 1, std::memory_order_release);
+    return true;
+  }
+
+  // pop removes the oldest entry into *v. Returns false if the queue is empty. Consumer only.
+  bool pop(T* v) {
+    size_t r = _r.load(std::memory_order_relaxed);
+    if (r == _w.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *v = _slots[r & (Size - 1)];
+    _r.store(r + 1, std::memory_order_release);
+    return true;
+  }
+
+  static constexpr size_t capacity() {
+    return Size;
+  }
+
+  size_t len() const {
+    return _w.load(std::memory_order_acquire) - _r.load(std::memory_order_acquire);
+  }
+};
@@ -0,0 +1,104 @@
+#pragma once
+#include <algorithm>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+
+// Minimal support for the *_test.cc programs (cc_test targets in BUILD).
+// CHECK reports a failed condition and carries on; main returns testExitCode().
+inline int testFailures = 0;
+
+#define CHECK(cond)                                                                                \
+  do {                                                                                             \
+    if (!(cond)) {                                                                                 \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond);                     \
+      testFailures++;                                                                              \
+    }                                                                                              \
+  } while (0)
+
+inline int testExitCode() {
+  if (testFailures > 0) {
+    fprintf(stderr, "%d checks failed\n", testFailures);
+    return 1;
+  }
+  return 0;
+}
+
+// testRand returns deterministic pseudo-random numbers (xorshift64)
+inline uint64_t testRand() {
+  static uint64_t s = 0x9e3779b97f4a7c15ull;
+  s ^= s << 13;
+  s ^= s >> 7;
+  s ^= s << 17;
+  return s;
+}
+
+// testByteAt returns the byte at position pos of the stream sent by testPipeStream
+inline char testByteAt(uint64_t pos) {
+  return (char)(pos * 31 % 251);
+}
+
+// testPipeStream moves a byte stream through p, a Pipe<Size> or MirrorPipe, in chunks of
+// random size up to p.cap(), mixing copying (write, read) with vectored file I/O
+// (readFromFD, writeToFD), so that every operation runs many times with the data
+// wrapping around the end of p's storage.
+template <typename P> void testPipeStream(P& p, int iterations) {
+  size_t cap = p.cap();
+  int in[2], out[2];
+  if (pipe(in) != 0 || pipe(out) != 0) {
+    perror("pipe");
+    CHECK(false);
+    return;
+  }
+  // a broken pipe implementation should fail checks, not block the test
+  for (int fd : {in[0], in[1], out[0], out[1]}) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+  uint64_t wpos = 0; // stream position of the next byte to go into p
+  uint64_t rpos = 0; // stream position of the next byte to come out of p
+  std::vector<char> buf(cap + 1);
+
+  for (int i = 0; i < iterations; i++) {
+    // add data
+    size_t n = testRand() % (cap + 2);
+    size_t expect = std::min(n, p.avail());
+    for (size_t k = 0; k < n; k++) {
+      buf[k] = testByteAt(wpos + k);
+    }
+    if (testRand() & 1) {
+      CHECK(p.write(buf.data(), n) == expect);
+    } else {
+      CHECK(write(in[1], buf.data(), expect) == (ssize_t)expect);
+      CHECK(p.readFromFD(in[0], n) == (ssize_t)expect);
+    }
+    wpos += expect;
+    CHECK(p.len() == wpos - rpos);
+    CHECK(p.len() + p.avail() == cap);
+
+    // take data out
+    n = testRand() % (cap + 2);
+    expect = std::min(n, p.len());
+    if (testRand() & 1) {
+      CHECK(p.read(buf.data(), n) == expect);
+    } else {
+      CHECK(p.writeToFD(out[1], n) == (ssize_t)expect);
+      CHECK(read(out[0], buf.data(), expect) == (ssize_t)expect);
+    }
+    for (size_t k = 0; k < expect; k++) {
+      if (buf[k] != testByteAt(rpos + k)) {
+        fprintf(stderr, "cap %zu: wrong byte at stream position %llu\n", cap,
+                (unsigned long long)(rpos + k));
+        CHECK(buf[k] == testByteAt(rpos + k));
+        break;
+      }
+    }
+    rpos += expect;
+    CHECK(p.len() == wpos - rpos);
+  }
+  close(in[0]);
+  close(in[1]);
+  close(out[0]);
+  close(out[1]);
+}
@@ -0,0 +1,103 @@
+#include "tracering.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <unistd.h> // getpid
+
+static_assert((TRACE_RING_SIZE & (TRACE_RING_SIZE - 1)) == 0, "must be a power of two");
+
+// A slot is written like a seqlock: seq is 0 while the fields are being written and
+// (uint32_t)(pos + 1) once they are complete, pos being the event's position in the ring.
+struct TraceSlot {
+  std::atomic<uint32_t> seq;
+  uint16_t tid;
+  uint8_t ev;
+  uint8_t _pad;
+  uint32_t conn;
+  uint32_t dur; // ns
+  uint64_t start;
+  uint64_t arg;
+};
+static_assert(sizeof(TraceSlot) == 32);
+
+static struct {
+  const char* name;
+  const char* argName; // null if the event has no argument
+  bool argIsChar;
+} eventInfo[TRACE_EVENT_COUNT] = {
+  {"read", "bytes", false},         {"msg in", "type", true},
+  {"write", "bytes", false},        {"flush", "bytes", false},
+  {"backpressure", nullptr, false}, {"frame start", "credits", false},
+  {"frame end", nullptr, false},    {"frame credits", "credits", false},
+  {"HandleCommands", "bytes", false},
+};
+
+std::atomic<bool> _traceEnabled{false};
+static std::atomic<uint64_t> _tracePos{0}; // next position to write
+static std::atomic<uint16_t> _traceTidGen{0};
+static TraceSlot _ring[TRACE_RING_SIZE]; // untouched (no memory used) until tracing starts
+
+void _traceRecord(TraceEvent ev, uint32_t conn, uint64_t start, uint64_t dur, uint64_t arg) {
+  static thread_local uint16_t tid = ++_traceTidGen;
+  uint64_t pos = _tracePos.fetch_add(1, std::memory_order_relaxed);
+  TraceSlot& s = _ring[pos & (TRACE_RING_SIZE - 1)];
+  s.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  s.tid = tid;
+  s.ev = ev;
+  s.conn = conn;
+  s.dur = (uint32_t)std::min(dur, (uint64_t)UINT32_MAX);
+  s.start = start;
+  s.arg = arg;
+  s.seq.store((uint32_t)(pos + 1), std::memory_order_release);
+}
+
+std::string traceExportJSON() {
+  std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+  int pid = (int)getpid();
+  uint64_t end = _tracePos.load(std::memory_order_acquire);
+  uint64_t begin = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+  bool first = true;
+  char buf[256];
+  for (uint64_t pos = begin; pos < end; pos++) {
+    const TraceSlot& slot = _ring[pos & (TRACE_RING_SIZE - 1)];
+    uint32_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq != (uint32_t)(pos + 1)) {
+      continue; // being written, or already overwritten
+    }
+    TraceSlot s;
+    s.tid = slot.tid;
+    s.ev = slot.ev;
+    s.conn = slot.conn;
+    s.dur = slot.dur;
+    s.start = slot.start;
+    s.arg = slot.arg;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != seq || s.ev >= TRACE_EVENT_COUNT) {
+      continue;
+    }
+    const auto& info = eventInfo[s.ev];
+    int n = snprintf(buf, sizeof(buf),
+                     "%s{\"name\":\"%s\",\"cat\":\"dawn\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,",
+                     first ? "" : ",\n", info.name, pid, s.tid, (double)s.start / 1e3);
+    if (s.dur > 0) {
+      n += snprintf(buf + n, sizeof(buf) - n, "\"ph\":\"X\",\"dur\":%.3f,", (double)s.dur / 1e3);
+    } else {
+      n += snprintf(buf + n, sizeof(buf) - n, "\"ph\":\"i\",\"s\":\"t\",");
+    }
+    n += snprintf(buf + n, sizeof(buf) - n, "\"args\":{\"conn\":%u", s.conn);
+    if (info.argName != nullptr && info.argIsChar) {
+      char c = (char)s.arg;
+      n += snprintf(buf + n, sizeof(buf) - n, ",\"%s\":\"%c\"", info.argName,
+                    c > ' ' && c < 127 && c != '"' && c != '\\' ? c : '?');
+    } else if (info.argName != nullptr) {
+      n += snprintf(buf + n, sizeof(buf) - n, ",\"%s\":%llu", info.argName,
+                    (unsigned long long)s.arg);
+    }
+    snprintf(buf + n, sizeof(buf) - n, "}}");
+    out += buf;
+    first = false;
+  }
+  out += "\n]}\n";
+  return out;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include "metrics.hh" // metricsNow
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+// The trace ring records protocol and server events in memory, in binary form, for
+// timeline analysis (see traceExportJSON). It is off by default. When off, recording an
+// event costs a relaxed load of a flag; when on, a clock read, an atomic increment and a
+// 32-byte store. Any thread may record events. The ring holds the latest
+// TRACE_RING_SIZE events; older ones are overwritten.
+#define TRACE_RING_SIZE (64 * 1024) /* number of events; power of two */
+
+enum TraceEvent : uint8_t {
+  TRACE_READ,            // span of reading & handling input; arg = bytes read
+  TRACE_MSG_IN,          // message received; arg = message type
+  TRACE_WRITE,           // data written to the socket; arg = bytes
+  TRACE_FLUSH,           // Dawn command data queued for output; arg = bytes
+  TRACE_BACKPRESSURE,    // span of a congested connection (see DawnRemoteProtocol::congested)
+  TRACE_FRAME_START,     // client frame started (onFrame); arg = credits left
+  TRACE_FRAME_END,       // client frame ended (endFrame)
+  TRACE_FRAME_CREDITS,   // frame credits received; arg = credits
+  TRACE_HANDLE_COMMANDS, // span of WireServer::HandleCommands; arg = bytes
+  TRACE_EVENT_COUNT
+};
+
+extern std::atomic<bool> _traceEnabled;
+void _traceRecord(TraceEvent ev, uint32_t conn, uint64_t start, uint64_t dur, uint64_t arg);
+
+inline bool traceEnabled() {
+  return _traceEnabled.load(std::memory_order_relaxed);
+}
+
+// traceEnable turns recording on or off. Async-signal-safe.
+inline void traceEnable(bool on) {
+  _traceEnabled.store(on, std::memory_order_relaxed);
+}
+
+// traceEvent records an instant event of connection conn
+inline void traceEvent(TraceEvent ev, uint32_t conn, uint64_t arg = 0) {
+  if (traceEnabled()) {
+    _traceRecord(ev, conn, metricsNow(), 0, arg);
+  }
+}
+
+// traceSpan records an event which lasted from start to end (metricsNow() timestamps).
+// traceBegin returns a start time, or 0 when tracing is off.
+inline uint64_t traceBegin() {
+  return traceEnabled() ? metricsNow() : 0;
+}
+inline void traceSpan(TraceEvent ev, uint32_t conn, uint64_t start, uint64_t end,
+                      uint64_t arg = 0) {
+  if (start != 0 && traceEnabled()) {
+    _traceRecord(ev, conn, start, end - start, arg);
+  }
+}
+
+// traceExportJSON returns the events in the ring in the Chrome trace event format,
+// which chrome://tracing and Perfetto can open. Events being recorded concurrently
+// may be left out.
+std::string traceExportJSON();
@@ -0,0 +1,164 @@
+// transportbench measures DawnRemoteProtocol round trips over a UNIX socket and over TCP
+// on the loopback interface. An echo server thread sends every Dawn command buffer back;
+// the client sends one buffer at a time and waits for it to come back. It then runs
+// frames through the credit based frame pacing, like a rendering client.
+//
+// usage: transportbench [UNIX_ADDR [TCP_ADDR]]   (see SockAddr)
+
+#define DLOG_PREFIX "\e[1;35m[bench]\e[0m "
+
+#include "common.hh"
+#include "protocol.hh"
+
+#include <ev.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+static const size_t messageSizes[] = {64, 1024, 16 * 1024, DAWNCMD_MAX, 1024 * 1024};
+
+// frame pacing run: frameCount frames of frameSize bytes of commands, frameCredits in flight
+static const size_t frameSize = 64 * 1024;
+static const size_t frameCount = 2000;
+static const uint32_t frameCredits = 3;
+
+// echoServer accepts one connection on lfd and echoes Dawn command data until it closes
+static void echoServer(int lfd, bool fdPassing) {
+  int fd = accept(lfd, nullptr, nullptr);
+  if (fd < 0) {
+    perror("accept");
+    return;
+  }
+  FDSetNonBlock(fd);
+  RunLoop* rl = ev_loop_new(EVFLAG_AUTO);
+  DawnRemoteProtocol proto;
+  proto.fdPassing = fdPassing;
+  proto.pauseWhenCongested = true;
+  proto.onDawnBuffer = [&](const char* data, size_t len) {
+    memcpy(proto.GetCmdSpace(len), data, len);
+    proto.Flush();
+  };
+  proto.onClose = [&]() { ev_break(rl, EVBREAK_ALL); };
+  // without onFrameEnd, each frame's credit is returned once its commands have been echoed
+  if (proto.start(rl, fd) && proto.sendFrameCredits(frameCredits)) {
+    ev_run(rl, 0);
+  } else {
+    perror("DawnRemoteProtocol::start");
+  }
+  proto.stop();
+  close(fd);
+  ev_loop_destroy(rl);
+}
+
+// benchFrames produces frames as fast as frame pacing allows and reports the time per frame
+static bool benchFrames(DawnRemoteProtocol& proto, RunLoop* rl, const SockAddr& addr) {
+  std::vector<char> cmds(frameSize, 'x');
+  size_t frames = 0;
+  proto.onFrame = [&]() {
+    memcpy(proto.GetCmdSpace(frameSize), cmds.data(), frameSize);
+    proto.Flush();
+    proto.endFrame();
+    if (++frames == frameCount) {
+      ev_break(rl, EVBREAK_ONE);
+    }
+  };
+  double start = ev_time();
+  proto.scheduleFrame(); // the server's credits arrived before onFrame was set
+  ev_run(rl, 0);
+  double elapsed = ev_time() - start;
+  proto.onFrame = nullptr;
+  if (frames != frameCount) {
+    fprintf(stderr, "%s: connection lost\n", fmtSockAddr(addr).c_str());
+    return false;
+  }
+  printf("%-28s %9zu %8zu %10.1f %10.1f  frames (drain %.1f us)\n", fmtSockAddr(addr).c_str(),
+         frameSize, frameCount, elapsed / frameCount * 1e6,
+         frameSize * frameCount / elapsed / (1024 * 1024), proto.frameDrainTime() * 1e6);
+  return true;
+}
+
+static bool benchTransport(const SockAddr& addr) {
+  int lfd = listenSocket(addr);
+  if (lfd < 0) {
+    perror(fmtSockAddr(addr).c_str());
+    return false;
+  }
+  bool fdPassing = !addr.tcp; // as configured by client and server
+  std::thread server(echoServer, lfd, fdPassing);
+
+  int fd = connectSocket(addr);
+  if (fd < 0) {
+    perror(fmtSockAddr(addr).c_str());
+    shutdown(lfd, SHUT_RDWR); // unblock accept
+    server.join();
+    close(lfd);
+    return false;
+  }
+  FDSetNonBlock(fd);
+  RunLoop* rl = ev_loop_new(EVFLAG_AUTO);
+  DawnRemoteProtocol proto;
+  proto.fdPassing = fdPassing;
+  size_t received = 0;
+  proto.onDawnBuffer = [&](const char* data, size_t len) { received = len; };
+  bool ok = proto.start(rl, fd);
+
+  for (size_t i = 0; ok && i < sizeof(messageSizes) / sizeof(messageSizes[0]); i++) {
+    size_t size = messageSizes[i];
+    std::vector<char> msg(size, 'x');
+    size_t iterations = std::clamp((size_t)(64 * 1024 * 1024) / size, (size_t)100, (size_t)20000);
+    double start = 0;
+    for (size_t n = 0; n < iterations + 10; n++) {
+      if (n == 10) {
+        start = ev_time(); // after warming up
+      }
+      memcpy(proto.GetCmdSpace(size), msg.data(), size);
+      proto.Flush();
+      received = 0;
+      while (received == 0 && !proto.stopped()) {
+        ev_run(rl, EVRUN_ONCE);
+      }
+      if (received != size) {
+        fprintf(stderr, "%s: connection lost\n", fmtSockAddr(addr).c_str());
+        ok = false;
+        break;
+      }
+    }
+    if (ok) {
+      double elapsed = ev_time() - start;
+      printf("%-28s %9zu %8zu %10.1f %10.1f\n", fmtSockAddr(addr).c_str(), size, iterations,
+             elapsed / iterations * 1e6, size * iterations / elapsed / (1024 * 1024));
+    }
+  }
+  ok = ok && benchFrames(proto, rl, addr);
+
+  proto.stop();
+  close(fd); // ends the echo server
+  server.join();
+  close(lfd);
+  if (!addr.tcp) {
+    unlink(addr.path.c_str());
+  }
+  ev_loop_destroy(rl);
+  return ok;
+}
+
+int main(int argc, const char* argv[]) {
+  const char* addrs[] = {"unix:/tmp/transportbench.sock", "tcp:127.0.0.1:47611"};
+  for (int i = 1; i < argc && i <= 2; i++) {
+    addrs[i - 1] = argv[i];
+  }
+  printf("%-28s %9s %8s %10s %10s\n", "transport", "size", "trips", "us/trip", "MB/s");
+  bool ok = true;
+  for (const char* s : addrs) {
+    SockAddr addr;
+    if (!parseSockAddr(s, &addr)) {
+      errlog("invalid address \"%s\"", s);
+      return 1;
+    }
+    ok = benchTransport(addr) && ok;
+  }
+  return ok ? 0 : 1;
+}